@@ -0,0 +1,230 @@
+#include "doomdriver.h"
+#include "doomdev2.h"
+
+#include <linux/string.h>
+
+
+// linear buffers are seen by the device as surfaces this wide; the SETUP page
+// table pointer can only move in steps of 64 PTEs, which is exactly one
+// window of 2048 rows
+#define LINEAR_WIDTH 128
+#define LINEAR_WINDOW (LINEAR_WIDTH*2048)
+#define LINEAR_WINDOW_PT_STEP ((LINEAR_WINDOW/HARDDOOM2_PAGE_SIZE*sizeof(uint32_t)) >> 8)
+
+
+struct linear_batch
+{
+    struct doomdevice* device;
+    uint32_t pos;
+    // held back, so that the last command can get PING_SYNC
+    cmd_t last;
+    int has_last;
+};
+
+
+static void batch_push(struct linear_batch* batch, cmd_t* command)
+{
+    if (batch->has_last)
+        ring_push(batch->device, &batch->pos, &batch->last);
+    batch->last = *command;
+    batch->has_last = 1;
+}
+
+
+static int batch_finish(struct linear_batch* batch)
+{
+    BUG_ON(!batch->has_last);
+
+    batch->last.w[0] |= HARDDOOM2_CMD_FLAG_PING_SYNC;
+    ring_push(batch->device, &batch->pos, &batch->last);
+    return ring_kick_wait(batch->device, batch->pos);
+}
+
+
+// the window of a linear buffer containing the given offset, as seen by SETUP
+static void linear_window(struct doombuffer* win, struct doombuffer* buf, uint32_t offset)
+{
+    win->dev_pagetable_handle = buf->dev_pagetable_handle + (offset / LINEAR_WINDOW) * LINEAR_WINDOW_PT_STEP;
+    win->width = LINEAR_WIDTH;
+}
+
+
+static void push_rect(struct linear_batch* batch, int fill, uint8_t value,
+    uint32_t src_off, uint32_t dst_off, uint32_t width, uint32_t height)
+{
+    cmd_t command = {0};
+
+    command.w[0] = HARDDOOM2_CMD_W0(fill ? HARDDOOM2_CMD_TYPE_FILL_RECT : HARDDOOM2_CMD_TYPE_COPY_RECT, 0);
+    command.w[2] = HARDDOOM2_CMD_W2(dst_off % LINEAR_WIDTH, dst_off / LINEAR_WIDTH, 0);
+    if (!fill)
+        command.w[3] = HARDDOOM2_CMD_W3(src_off % LINEAR_WIDTH, src_off / LINEAR_WIDTH);
+    command.w[6] = HARDDOOM2_CMD_W6_A(width, height, fill ? value : 0);
+
+    batch_push(batch, &command);
+}
+
+
+// offsets are relative to the windows, both are in the same column
+static void push_linear(struct linear_batch* batch, int fill, uint8_t value,
+    uint32_t src_off, uint32_t dst_off, uint32_t len)
+{
+    uint32_t x = dst_off % LINEAR_WIDTH;
+    uint32_t part;
+
+    if (x != 0)
+    {
+        part = min(len, LINEAR_WIDTH - x);
+        push_rect(batch, fill, value, src_off, dst_off, part, 1);
+        src_off += part;
+        dst_off += part;
+        len -= part;
+    }
+
+    if (len >= LINEAR_WIDTH)
+    {
+        part = len / LINEAR_WIDTH;
+        push_rect(batch, fill, value, src_off, dst_off, LINEAR_WIDTH, part);
+        src_off += part*LINEAR_WIDTH;
+        dst_off += part*LINEAR_WIDTH;
+        len -= part*LINEAR_WIDTH;
+    }
+
+    if (len != 0)
+        push_rect(batch, fill, value, src_off, dst_off, len, 1);
+}
+
+
+// caller holds the device lock
+static int device_blit(struct doomdevice* device, struct doombuffer* src, uint32_t src_off,
+    struct doombuffer* dst, uint32_t dst_off, uint32_t size, int fill, uint8_t value)
+{
+    struct doombuffer src_win;
+    struct doombuffer dst_win;
+    struct doombuffer* buffers[7] = {&dst_win, fill ? NULL : &src_win, NULL, NULL, NULL, NULL, NULL};
+    struct linear_batch batch;
+
+    batch.device = device;
+    batch.pos = ring_begin(device);
+    batch.has_last = 0;
+
+    while (size != 0)
+    {
+        uint32_t len = min(size, LINEAR_WINDOW - dst_off % LINEAR_WINDOW);
+
+        if (!fill)
+            len = min(len, (uint32_t)(LINEAR_WINDOW - src_off % LINEAR_WINDOW));
+
+        // every piece stays within one window of each buffer
+        linear_window(&dst_win, dst, dst_off);
+        if (!fill)
+            linear_window(&src_win, src, src_off);
+
+        if (batch.has_last)
+            ring_push(device, &batch.pos, &batch.last);
+        batch.has_last = 0;
+        ring_setup(device, &batch.pos, buffers);
+
+        push_linear(&batch, fill, value, src_off % LINEAR_WINDOW, dst_off % LINEAR_WINDOW, len);
+
+        src_off += len;
+        dst_off += len;
+        size -= len;
+    }
+
+    return batch_finish(&batch);
+}
+
+
+static int cpu_blit(struct doombuffer* src, uint32_t src_off,
+    struct doombuffer* dst, uint32_t dst_off, uint32_t size, int fill, uint8_t value)
+{
+    int err;
+    int ret;
+
+    if (size == 0)
+        return 0;
+
+    if (!fill && (err = sync_buffer_for_cpu(src, src_off, size)))
+        goto err_src;
+    if ((err = sync_buffer_for_cpu(dst, dst_off, size)))
+        goto err_dst;
+
+    if (fill)
+        memset(dst->vaddr + dst_off, value, size);
+    else
+        memmove(dst->vaddr + dst_off, src->vaddr + src_off, size);
+
+    err = sync_buffer_cpu_done(dst, dst_off, size, 1);
+    buffer_touch(dst);
+err_dst:
+
+    if (!fill && (ret = sync_buffer_cpu_done(src, src_off, size, 0)) && !err)
+        err = ret;
+err_src:
+
+    return err;
+}
+
+
+// copies (or fills, when src is NULL) a byte range of a buffer; the 64-byte
+// aligned middle goes through the device, the ends are done on the CPU
+int blit_buffer_range(struct doombuffer* src, uint32_t src_off,
+    struct doombuffer* dst, uint32_t dst_off, uint32_t size, uint8_t value)
+{
+    int err;
+    struct doomdevice* device = dst->device;
+    int fill = src == NULL;
+    uint32_t head;
+    uint32_t body;
+
+    if (buffer_root(dst)->flags & DOOMBUFFER_READONLY)
+        return EPERM;
+
+    if ((uint64_t)dst_off + size > dst->size)
+        return EINVAL;
+
+    if (!fill && ((uint64_t)src_off + size > src->size || src->device != device))
+        return EINVAL;
+
+    // the device only moves whole columns of the pseudo-surface, so both
+    // sides have to sit at the same column; overlapping copies are left to
+    // memmove
+    if (size < HARDDOOM2_BLOCK_SIZE ||
+        (!fill && ((src_off - dst_off) % LINEAR_WIDTH != 0 || buffer_root(src) == buffer_root(dst))))
+    {
+        mutex_lock(&dst->lock);
+        err = cpu_blit(src, src_off, dst, dst_off, size, fill, value);
+        mutex_unlock(&dst->lock);
+        return err;
+    }
+
+    head = (HARDDOOM2_BLOCK_SIZE - dst_off % HARDDOOM2_BLOCK_SIZE) % HARDDOOM2_BLOCK_SIZE;
+    body = (size - head) & ~(HARDDOOM2_BLOCK_SIZE-1);
+
+    mutex_lock(&dst->lock);
+
+    if ((err = cpu_blit(src, src_off, dst, dst_off, head, fill, value)) ||
+        (err = cpu_blit(src, src_off + head + body, dst, dst_off + head + body, size - head - body, fill, value)))
+        goto err_cpu;
+
+    if (!fill)
+        sync_buffer_for_device(src, src_off + head, body);
+
+    if (body != 0)
+    {
+        atomic_inc(&device->queued);
+        mutex_lock(&device->lock);
+        if (0 == (err = ring_ready(device)))
+            err = device_blit(device, src, src_off + head, dst, dst_off + head, body, fill, value);
+        mutex_unlock(&device->lock);
+        atomic_dec(&device->queued);
+    }
+
+    // whoever reads it next on the CPU syncs for itself
+    buffer_touch(dst);
+
+err_cpu:
+    mutex_unlock(&dst->lock);
+
+    return err;
+}
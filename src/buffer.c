@@ -1,24 +1,360 @@
 #include "doomdriver.h"
+#include "doomdev2.h"
 
 #include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/highmem.h>
+#include <linux/shrinker.h>
+#include <linux/moduleparam.h>
 #include <linux/uaccess.h>
 
 
 static int buffer_release(struct inode *ino, struct file *filep);
-static ssize_t buffer_read(struct file *file, char __user *user_data, size_t size, loff_t *off);
-static ssize_t buffer_write(struct file *file, const char __user *user_data, size_t size, loff_t *off);
+static ssize_t buffer_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t buffer_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static loff_t buffer_llseek(struct file *file, loff_t off, int whence);
+static long buffer_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int buffer_mmap(struct file *file, struct vm_area_struct *vma);
 
 struct file_operations buffer_fops = {
     .owner = THIS_MODULE,
-    .read = buffer_read,
-    .write = buffer_write,
+    .read_iter = buffer_read_iter,
+    .write_iter = buffer_write_iter,
+    .splice_write = iter_file_splice_write,
     .llseek = buffer_llseek,
+    .unlocked_ioctl = buffer_ioctl,
+    .compat_ioctl = buffer_ioctl,
+    .mmap = buffer_mmap,
     .release = buffer_release,
 };
 
 
-struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uint32_t width, uint32_t height)
+static unsigned int pool_pages = 1024;
+module_param(pool_pages, uint, 0644);
+MODULE_PARM_DESC(pool_pages, "Freed pages kept mapped for reuse, per device");
+
+
+// owned pages may come from the pool, so they are always mapped both ways
+#define BUFFER_DMA_DIR(buf) ((buffer_root(buf)->flags & (DOOMBUFFER_USERPTR|DOOMBUFFER_READONLY)) == (DOOMBUFFER_USERPTR|DOOMBUFFER_READONLY) ? DMA_TO_DEVICE : DMA_BIDIRECTIONAL)
+
+
+int alloc_dev_pagetable(struct doombuffer* buf, int n_pages)
+{
+    dma_addr_t temp_handle;
+
+    if (0 == (buf->dev_pagetable = dma_alloc_coherent(
+        buf->device->dev,
+        sizeof(uint32_t)*n_pages,
+        &temp_handle,
+        GFP_KERNEL
+    )))
+        return ENOMEM;
+
+    BUG_ON((temp_handle & 255) != 0);
+
+    buf->dev_pagetable_handle = temp_handle >> 8;
+    return 0;
+}
+
+
+void free_dev_pagetable(struct doombuffer* buf, int n_pages)
+{
+    dma_free_coherent(
+        buf->device->dev,
+        sizeof(uint32_t)*n_pages,
+        buf->dev_pagetable,
+        buf->dev_pagetable_handle << 8
+    );
+}
+
+
+// takes a page from the pool or allocates a fresh one, mapped for the device
+static struct page* get_device_page(struct doomdevice* device, int node, dma_addr_t* handle)
+{
+    struct page* page = NULL;
+
+    // the pool only holds pages from the device's own node; a device
+    // without one (NUMA_NO_NODE) pools pages from anywhere
+    if (node != device->node)
+        goto alloc_fresh;
+
+    spin_lock(&device->pool_lock);
+    page = list_first_entry_or_null(&device->pool, struct page, lru);
+    if (page != NULL)
+    {
+        list_del(&page->lru);
+        device->pool_c--;
+    }
+    spin_unlock(&device->pool_lock);
+
+    if (page != NULL)
+    {
+        *handle = page_private(page);
+        // zeroed, so that nothing leaks to the user through read()
+        clear_highpage(page);
+        dma_sync_single_for_device(device->dev, *handle, PAGE_SIZE, DMA_BIDIRECTIONAL);
+        return page;
+    }
+
+alloc_fresh:
+    // charged to the memory cgroup of the allocating process
+    if (0 == (page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_ACCOUNT, 0)))
+        return NULL;
+
+    *handle = dma_map_page(device->dev, page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(device->dev, *handle))
+    {
+        __free_page(page);
+        return NULL;
+    }
+
+    return page;
+}
+
+
+static void put_device_page(struct doomdevice* device, struct page* page, dma_addr_t handle)
+{
+    spin_lock(&device->pool_lock);
+    if (device->pool_c < pool_pages &&
+        (device->node == NUMA_NO_NODE || page_to_nid(page) == device->node))
+    {
+        set_page_private(page, handle);
+        list_add(&page->lru, &device->pool);
+        device->pool_c++;
+        page = NULL;
+    }
+    spin_unlock(&device->pool_lock);
+
+    if (page != NULL)
+    {
+        dma_unmap_page(device->dev, handle, PAGE_SIZE, DMA_BIDIRECTIONAL);
+        __free_page(page);
+    }
+}
+
+
+static unsigned long pool_trim(struct doomdevice* device, unsigned long nr_to_scan)
+{
+    struct page* page;
+    struct page* next;
+    unsigned long freed = 0;
+    LIST_HEAD(victims);
+
+    spin_lock(&device->pool_lock);
+    while (freed < nr_to_scan && !list_empty(&device->pool))
+    {
+        list_move(device->pool.next, &victims);
+        device->pool_c--;
+        freed++;
+    }
+    spin_unlock(&device->pool_lock);
+
+    list_for_each_entry_safe(page, next, &victims, lru)
+    {
+        list_del(&page->lru);
+        dma_unmap_page(device->dev, page_private(page), PAGE_SIZE, DMA_BIDIRECTIONAL);
+        set_page_private(page, 0);
+        __free_page(page);
+    }
+
+    return freed;
+}
+
+
+// swaps the pages of a DONTNEED buffer for the dummy page; caller holds
+// purge_lock and the buffer lock
+static unsigned long purge_buffer(struct doombuffer* buf)
+{
+    struct doomdevice* device = buf->device;
+    uint32_t i;
+
+    vunmap(buf->vaddr);
+    buf->vaddr = device->dummy_vaddr;
+
+    for (i = 0; i < buf->page_c; i++)
+    {
+        dma_addr_t handle = PTE_DMA_ADDR(buf->dev_pagetable[i]);
+
+        buf->dev_pagetable[i] = HARDDOOM2_PTE_VALID | (device->dummy_handle >> 8);
+
+        // under memory pressure there is no point in pooling them
+        atomic64_sub(PAGE_SIZE, &device->node_used[page_to_nid(buf->pages[i])]);
+        dma_unmap_page(device->dev, handle, PAGE_SIZE, DMA_BIDIRECTIONAL);
+        __free_page(buf->pages[i]);
+        buf->pages[i] = device->dummy_page;
+    }
+
+    atomic64_sub(buf->page_c*PAGE_SIZE, &device->mem_used);
+    buf->flags |= DOOMBUFFER_PURGED;
+    buf->pt_gen = next_gen(device);
+
+    return buf->page_c;
+}
+
+
+static unsigned long purge_scan(struct doomdevice* device, unsigned long nr_to_scan)
+{
+    struct doombuffer* buf;
+    struct doombuffer* next;
+    unsigned long freed = 0;
+
+    if (!mutex_trylock(&device->purge_lock))
+        return 0;
+
+    list_for_each_entry_safe(buf, next, &device->purgeable, purge_node)
+    {
+        if (freed >= nr_to_scan)
+            break;
+
+        if (!mutex_trylock(&buf->lock))
+            continue;
+
+        // any other reference (a view, an export, a SETUP, an ioctl in
+        // flight) may still hand the pages to the device
+        if (file_count(buf->file) == 1)
+        {
+            freed += purge_buffer(buf);
+            device->purgeable_c -= buf->page_c;
+            list_del_init(&buf->purge_node);
+        }
+
+        mutex_unlock(&buf->lock);
+    }
+
+    mutex_unlock(&device->purge_lock);
+
+    return freed;
+}
+
+
+static unsigned long pool_count(struct shrinker* shrinker, struct shrink_control* sc)
+{
+    struct doomdevice* device = shrinker->private_data;
+
+    return (READ_ONCE(device->pool_c) + READ_ONCE(device->purgeable_c)) ?: SHRINK_EMPTY;
+}
+
+
+// the pool goes first, purgeable buffers only when that is not enough
+static unsigned long pool_scan(struct shrinker* shrinker, struct shrink_control* sc)
+{
+    struct doomdevice* device = shrinker->private_data;
+    unsigned long freed;
+
+    freed = pool_trim(device, sc->nr_to_scan);
+    if (freed < sc->nr_to_scan)
+        freed += purge_scan(device, sc->nr_to_scan - freed);
+
+    return freed ?: SHRINK_STOP;
+}
+
+
+int buffer_pool_init(struct doomdevice* device)
+{
+    int err;
+    struct page** dummies;
+    int i;
+
+    spin_lock_init(&device->pool_lock);
+    INIT_LIST_HEAD(&device->pool);
+    device->pool_c = 0;
+
+    spin_lock_init(&device->buffers_lock);
+    INIT_LIST_HEAD(&device->buffers);
+    atomic64_set(&device->mem_used, 0);
+
+    mutex_init(&device->shared_lock);
+    INIT_LIST_HEAD(&device->shared);
+
+    mutex_init(&device->purge_lock);
+    INIT_LIST_HEAD(&device->purgeable);
+    device->purgeable_c = 0;
+
+    if (0 == (device->node_used = kcalloc_node(nr_node_ids, sizeof(atomic64_t), GFP_KERNEL, device->node)))
+    {
+        err = ENOMEM;
+        goto err_node_used;
+    }
+
+    // what purged buffers map instead of their pages, for both the device
+    // and the CPU; the device maps it read-only and CPU access to purged
+    // buffers fails, so it cannot carry data between clients
+    if (0 == (device->dummy_page = alloc_pages_node(device->node, GFP_KERNEL | __GFP_ZERO, 0)))
+    {
+        err = ENOMEM;
+        goto err_dummy_page;
+    }
+
+    device->dummy_handle = dma_map_page(device->dev, device->dummy_page, 0, PAGE_SIZE, DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(device->dev, device->dummy_handle))
+    {
+        err = ENOMEM;
+        goto err_dummy_map;
+    }
+
+    if (0 == (dummies = kmalloc_array(DOOMBUFFER_MAX_PAGES, sizeof(struct page*), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_dummy_vmap;
+    }
+    for (i = 0; i < DOOMBUFFER_MAX_PAGES; i++)
+        dummies[i] = device->dummy_page;
+    device->dummy_vaddr = vmap(dummies, DOOMBUFFER_MAX_PAGES, VM_MAP, PAGE_KERNEL);
+    kfree(dummies);
+
+    if (device->dummy_vaddr == NULL)
+    {
+        err = ENOMEM;
+        goto err_dummy_vmap;
+    }
+
+    if (0 == (device->shrinker = shrinker_alloc(0, DRIVER_NAME "-%d", device->id)))
+    {
+        err = ENOMEM;
+        goto err_shrinker;
+    }
+
+    device->shrinker->count_objects = pool_count;
+    device->shrinker->scan_objects = pool_scan;
+    device->shrinker->private_data = device;
+    shrinker_register(device->shrinker);
+
+    return 0;
+
+    shrinker_free(device->shrinker);
+err_shrinker:
+
+    vunmap(device->dummy_vaddr);
+err_dummy_vmap:
+
+    dma_unmap_page(device->dev, device->dummy_handle, PAGE_SIZE, DMA_BIDIRECTIONAL);
+err_dummy_map:
+
+    __free_page(device->dummy_page);
+err_dummy_page:
+
+    kfree(device->node_used);
+err_node_used:
+
+    return err;
+}
+
+
+void buffer_pool_exit(struct doomdevice* device)
+{
+    shrinker_free(device->shrinker);
+    pool_trim(device, ULONG_MAX);
+    vunmap(device->dummy_vaddr);
+    dma_unmap_page(device->dev, device->dummy_handle, PAGE_SIZE, DMA_BIDIRECTIONAL);
+    __free_page(device->dummy_page);
+    kfree(device->node_used);
+}
+
+
+struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uint32_t width, uint32_t height, int node)
 {
     int err;
     struct doombuffer* buf;
@@ -26,7 +362,11 @@ struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uin
 
     dma_addr_t temp_handle;
 
-    if (0 == (buf = kmem_cache_alloc(doombuffer_cache, 0)))
+    // close to the device unless the caller knows better
+    if (node == NUMA_NO_NODE)
+        node = device->node;
+
+    if (0 == (buf = kmem_cache_alloc_node(doombuffer_cache, GFP_KERNEL, node)))
     {
         err = ENOMEM;
         goto err_cache_alloc;
@@ -35,105 +375,540 @@ struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uin
     buf->size = size;
     buf->width = width;
     buf->height = height;
+    buf->parent = NULL;
+    buf->flags = 0;
+    buf->mm = NULL;
+    buf->attach = NULL;
+    buf->sgt = NULL;
+    buf->shared = NULL;
+    INIT_LIST_HEAD(&buf->purge_node);
     mutex_init(&buf->lock);
     buf->device = device;
+    buf->pt_gen = buf->gen = next_gen(buf->device);
+    buf->grabbed_by = NULL;
+    buf->grab_failed = 0;
 
-    if (0 == (buf->dev_pagetable = dma_alloc_coherent(
-        &buf->device->pci_device->dev,
-        sizeof(uint32_t)*n_pages,
-        &temp_handle,
-        0
-    )))
+    if ((err = alloc_dev_pagetable(buf, n_pages)))
+        goto err_alloc_dev_pagetable;
+
+    if (0 == (buf->pages = kmalloc_array_node(n_pages, sizeof(struct page*), GFP_KERNEL_ACCOUNT, node)))
+    {
+        err = ENOMEM;
+        goto err_alloc_pages_array;
+    }
+
+    buf->page_c = 0;
+    while (buf->page_c < n_pages)
+    {
+        struct page* page;
+
+        if (0 == (page = get_device_page(device, node, &temp_handle)))
+        {
+            err = ENOMEM;
+            goto err_alloc_pages;
+        }
+
+        BUG_ON((temp_handle & 255) != 0);
+        buf->pages[buf->page_c] = page;
+        buf->dev_pagetable[buf->page_c] = HARDDOOM2_PTE_VALID|HARDDOOM2_PTE_WRITABLE | (temp_handle >> 8);
+        atomic64_add(PAGE_SIZE, &device->node_used[page_to_nid(page)]);
+        buf->page_c++;
+    }
+
+    // one contiguous kernel mapping, so that copies need not go page by page
+    if (0 == (buf->vaddr = vmap(buf->pages, n_pages, VM_MAP, PAGE_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_pages;
+    }
+
+    buf->owner = get_task_pid(current, PIDTYPE_TGID);
+    atomic64_add(n_pages*PAGE_SIZE, &device->mem_used);
+    spin_lock(&device->buffers_lock);
+    list_add(&buf->node, &device->buffers);
+    spin_unlock(&device->buffers_lock);
+
+    return buf;
+
+    vunmap(buf->vaddr);
+err_alloc_pages:
+    while (buf->page_c)
+    {
+        buf->page_c--;
+        atomic64_sub(PAGE_SIZE, &device->node_used[page_to_nid(buf->pages[buf->page_c])]);
+        put_device_page(
+            device,
+            buf->pages[buf->page_c],
+            PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c])
+        );
+    }
+
+    kfree(buf->pages);
+err_alloc_pages_array:
+
+    free_dev_pagetable(buf, n_pages);
+err_alloc_dev_pagetable:
+
+    kmem_cache_free(doombuffer_cache, buf);
+err_cache_alloc:
+
+    return ERR_PTR(-err);
+}
+
+struct doombuffer* alloc_userptr(struct doomdevice* device, unsigned long addr, uint32_t size, int readonly)
+{
+    int err;
+    struct doombuffer* buf;
+    int n_pages = (size+PAGE_SIZE-1)/PAGE_SIZE;
+    int pinned;
+    uint32_t pte_flags;
+
+    dma_addr_t temp_handle;
+
+    BUG_ON((addr & (PAGE_SIZE-1)) != 0);
+
+    if (0 == (buf = kmem_cache_alloc(doombuffer_cache, GFP_KERNEL)))
     {
         err = ENOMEM;
+        goto err_cache_alloc;
+    }
+
+    buf->size = size;
+    buf->width = 0;
+    buf->height = 0;
+    buf->parent = NULL;
+    buf->flags = DOOMBUFFER_USERPTR | (readonly ? DOOMBUFFER_READONLY : 0);
+    buf->attach = NULL;
+    buf->sgt = NULL;
+    buf->shared = NULL;
+    INIT_LIST_HEAD(&buf->purge_node);
+    mutex_init(&buf->lock);
+    buf->device = device;
+    buf->pt_gen = buf->gen = next_gen(buf->device);
+    buf->grabbed_by = NULL;
+    buf->grab_failed = 0;
+
+    pte_flags = HARDDOOM2_PTE_VALID | (readonly ? 0 : HARDDOOM2_PTE_WRITABLE);
+
+    if ((err = alloc_dev_pagetable(buf, n_pages)))
         goto err_alloc_dev_pagetable;
+
+    if (0 == (buf->pages = kmalloc_array(n_pages, sizeof(struct page*), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_pages_array;
     }
 
-    BUG_ON((temp_handle & 255) != 0);
+    // pinned pages count against RLIMIT_MEMLOCK of the caller
+    buf->mm = current->mm;
+    mmgrab(buf->mm);
+    if ((err = -account_locked_vm(buf->mm, n_pages, true)))
+        goto err_account;
 
-    buf->dev_pagetable_handle = temp_handle >> 8;
+    pinned = pin_user_pages_fast(
+        addr,
+        n_pages,
+        FOLL_LONGTERM | (readonly ? 0 : FOLL_WRITE),
+        buf->pages
+    );
+    if (pinned != n_pages)
+    {
+        if (pinned > 0)
+            unpin_user_pages(buf->pages, pinned);
+        err = pinned < 0 ? -pinned : EFAULT;
+        goto err_pin;
+    }
+
+    buf->page_c = 0;
+    while (buf->page_c < n_pages)
+    {
+        temp_handle = dma_map_page(
+            buf->device->dev,
+            buf->pages[buf->page_c],
+            0,
+            PAGE_SIZE,
+            BUFFER_DMA_DIR(buf)
+        );
+        if (dma_mapping_error(buf->device->dev, temp_handle))
+        {
+            err = ENOMEM;
+            goto err_map_pages;
+        }
+
+        BUG_ON((temp_handle & 255) != 0);
+        buf->dev_pagetable[buf->page_c] = pte_flags | (temp_handle >> 8);
+        buf->page_c++;
+    }
+
+    if (0 == (buf->vaddr = vmap(buf->pages, n_pages, VM_MAP, PAGE_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_map_pages;
+    }
+
+    return buf;
+
+    vunmap(buf->vaddr);
+err_map_pages:
+    while (buf->page_c)
+    {
+        buf->page_c--;
+        dma_unmap_page(
+            buf->device->dev,
+            PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c]),
+            PAGE_SIZE,
+            BUFFER_DMA_DIR(buf)
+        );
+    }
+
+    unpin_user_pages(buf->pages, n_pages);
+err_pin:
+
+    account_locked_vm(buf->mm, n_pages, false);
+err_account:
+
+    mmdrop(buf->mm);
+    kfree(buf->pages);
+err_alloc_pages_array:
+
+    free_dev_pagetable(buf, n_pages);
+err_alloc_dev_pagetable:
+
+    kmem_cache_free(doombuffer_cache, buf);
+err_cache_alloc:
+
+    return ERR_PTR(-err);
+}
+
+struct doombuffer* alloc_view(struct doombuffer* src, uint32_t offset, uint32_t size)
+{
+    int err;
+    struct doombuffer* buf;
+    uint32_t first_page = offset/PAGE_SIZE;
+    int n_pages = (size+PAGE_SIZE-1)/PAGE_SIZE;
+
+    BUG_ON((offset & (PAGE_SIZE-1)) != 0);
+    BUG_ON(offset + size > src->size);
+
+    if (0 == (buf = kmem_cache_alloc(doombuffer_cache, GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_cache_alloc;
+    }
+
+    buf->size = size;
+    buf->width = 0;
+    buf->height = 0;
+    // the view keeps the surface geometry as long as it covers whole rows
+    if (src->width != 0 && offset % src->width == 0 && size % src->width == 0)
+    {
+        buf->width = src->width;
+        buf->height = size / src->width;
+    }
+    // views of views borrow straight from the owner of the pages
+    buf->parent = buffer_root(src);
+    buf->flags = 0;
+    buf->mm = NULL;
+    buf->attach = NULL;
+    buf->sgt = NULL;
+    buf->shared = NULL;
+    INIT_LIST_HEAD(&buf->purge_node);
+    mutex_init(&buf->lock);
+    buf->device = src->device;
+    buf->pt_gen = buf->gen = next_gen(buf->device);
+    buf->grabbed_by = NULL;
+    buf->grab_failed = 0;
+
+    if ((err = alloc_dev_pagetable(buf, n_pages)))
+        goto err_alloc_dev_pagetable;
+
+    // the parent mapping is contiguous, so a view is just a window into it
+    buf->pages = src->pages != NULL ? src->pages + first_page : NULL;
+    buf->vaddr = src->vaddr + offset;
+
+    for (buf->page_c = 0; buf->page_c < n_pages; buf->page_c++)
+        buf->dev_pagetable[buf->page_c] = src->dev_pagetable[first_page + buf->page_c];
+
+    // the pages live as long as their owner does
+    get_file(buf->parent->file);
+
+    return buf;
+
+err_alloc_dev_pagetable:
+
+    kmem_cache_free(doombuffer_cache, buf);
+err_cache_alloc:
+
+    return ERR_PTR(-err);
+}
+
+// the same pages, mapped for another device with a page table of its own
+struct doombuffer* alloc_attached(struct doomdevice* device, struct doombuffer* src)
+{
+    int err;
+    struct doombuffer* buf;
+    int n_pages = (src->size+PAGE_SIZE-1)/PAGE_SIZE;
+
+    dma_addr_t temp_handle;
+
+    BUG_ON(src->pages == NULL);
+
+    if (0 == (buf = kmem_cache_alloc_node(doombuffer_cache, GFP_KERNEL, device->node)))
+    {
+        err = ENOMEM;
+        goto err_cache_alloc;
+    }
+
+    buf->size = src->size;
+    buf->width = src->width;
+    buf->height = src->height;
+    buf->parent = buffer_root(src);
+    buf->flags = DOOMBUFFER_ATTACHED;
+    buf->mm = NULL;
+    buf->attach = NULL;
+    buf->sgt = NULL;
+    buf->shared = NULL;
+    INIT_LIST_HEAD(&buf->purge_node);
+    mutex_init(&buf->lock);
+    buf->device = device;
+    buf->pt_gen = buf->gen = next_gen(buf->device);
+    buf->grabbed_by = NULL;
+    buf->grab_failed = 0;
+
+    if ((err = alloc_dev_pagetable(buf, n_pages)))
+        goto err_alloc_dev_pagetable;
 
-    if (0 == (buf->usr_pagetable = kmalloc(sizeof(uint8_t*)*n_pages, 0)))
-    {
-        err = ENOMEM;
-        goto err_alloc_usr_pagetable;
-    }
+    buf->pages = src->pages;
+    buf->vaddr = src->vaddr;
 
-    buf->page_c = 0;
-    while (buf->page_c < n_pages)
+    for (buf->page_c = 0; buf->page_c < n_pages; buf->page_c++)
     {
-        if (0 == (buf->usr_pagetable[buf->page_c] = dma_alloc_coherent(
-            &buf->device->pci_device->dev,
+        temp_handle = dma_map_page(
+            device->dev,
+            buf->pages[buf->page_c],
+            0,
             PAGE_SIZE,
-            &temp_handle,
-            0
-        )))
+            BUFFER_DMA_DIR(buf)
+        );
+        if (dma_mapping_error(device->dev, temp_handle))
         {
             err = ENOMEM;
-            goto err_alloc_pages;
+            goto err_map_pages;
         }
-        BUG_ON((temp_handle & 255) != 0);
-        buf->dev_pagetable[buf->page_c] = HARDDOOM2_PTE_VALID|HARDDOOM2_PTE_WRITABLE | (temp_handle >> 8);
-        buf->page_c++;
+
+        // the CPU syncs only the mapping of the root device, so with bounce
+        // buffers or non-coherent caches what the other device draws (see
+        // split.c) would never be seen
+        if (dma_need_sync(device->dev, temp_handle) ||
+            dma_need_sync(src->device->dev, PTE_DMA_ADDR(src->dev_pagetable[buf->page_c])))
+        {
+            dma_unmap_page(device->dev, temp_handle, PAGE_SIZE, BUFFER_DMA_DIR(buf));
+            err = EOPNOTSUPP;
+            goto err_map_pages;
+        }
+
+        // read-only sources stay read-only for every device
+        buf->dev_pagetable[buf->page_c] = HARDDOOM2_PTE_VALID |
+            (src->dev_pagetable[buf->page_c] & HARDDOOM2_PTE_WRITABLE) | (temp_handle >> 8);
     }
 
+    get_file(buf->parent->file);
+
     return buf;
 
-err_alloc_pages:
+err_map_pages:
     while (buf->page_c)
     {
         buf->page_c--;
-        dma_free_coherent(
-            &buf->device->pci_device->dev,
+        dma_unmap_page(
+            device->dev,
+            PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c]),
             PAGE_SIZE,
-            buf->usr_pagetable[buf->page_c],
-            (buf->dev_pagetable[buf->page_c] & HARDDOOM2_PTE_PHYS_MASK) << 8
+            BUFFER_DMA_DIR(buf)
         );
     }
 
-    kfree(buf->usr_pagetable);
-err_alloc_usr_pagetable:
-
-    dma_free_coherent(
-        &buf->device->pci_device->dev,
-        PAGE_SIZE,
-        buf->dev_pagetable,
-        buf->dev_pagetable_handle << 8
-    );
+    free_dev_pagetable(buf, n_pages);
 err_alloc_dev_pagetable:
 
     kmem_cache_free(doombuffer_cache, buf);
 err_cache_alloc:
 
-    return ERR_PTR(err);
+    return ERR_PTR(-err);
 }
 
 void free_pagetable(struct doombuffer* buf)
 {
+    int n_pages = (buf->size+PAGE_SIZE-1)/PAGE_SIZE;
+
+    // views only drop their reference, the pages belong to the parent
+    if (buf->parent != NULL)
+    {
+        while ((buf->flags & DOOMBUFFER_ATTACHED) && buf->page_c)
+        {
+            buf->page_c--;
+            dma_unmap_page(
+                buf->device->dev,
+                PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c]),
+                PAGE_SIZE,
+                BUFFER_DMA_DIR(buf)
+            );
+        }
+        free_dev_pagetable(buf, n_pages);
+        if (buf->flags & DOOMBUFFER_SHARED)
+            put_shared_buffer(buf->parent);
+        fput(buf->parent->file);
+        kmem_cache_free(doombuffer_cache, buf);
+        return;
+    }
+
+    if (buf->flags & DOOMBUFFER_DMABUF)
+    {
+        // the page table covers the whole dma-buf, which a surface may
+        // only use part of
+        release_imported_dmabuf(buf);
+        free_dev_pagetable(buf, buf->page_c);
+        kmem_cache_free(doombuffer_cache, buf);
+        return;
+    }
+
+    if (buf->flags & DOOMBUFFER_DONTNEED)
+    {
+        mutex_lock(&buf->device->purge_lock);
+        if (!list_empty(&buf->purge_node))
+        {
+            list_del(&buf->purge_node);
+            buf->device->purgeable_c -= buf->page_c;
+        }
+        mutex_unlock(&buf->device->purge_lock);
+    }
+
+    // a purged buffer has nothing left but the dummy page
+    if (buf->flags & DOOMBUFFER_PURGED)
+        buf->page_c = 0;
+    else
+        vunmap(buf->vaddr);
+
+    if (!(buf->flags & DOOMBUFFER_USERPTR))
+    {
+        spin_lock(&buf->device->buffers_lock);
+        list_del(&buf->node);
+        spin_unlock(&buf->device->buffers_lock);
+        if (!(buf->flags & DOOMBUFFER_PURGED))
+            atomic64_sub(n_pages*PAGE_SIZE, &buf->device->mem_used);
+        put_pid(buf->owner);
+    }
+
     while (buf->page_c)
     {
         buf->page_c--;
-        dma_free_coherent(
-            &buf->device->pci_device->dev,
-            PAGE_SIZE,
-            buf->usr_pagetable[buf->page_c],
-            (buf->dev_pagetable[buf->page_c] & HARDDOOM2_PTE_PHYS_MASK) << 8
-        );
+        if (buf->flags & DOOMBUFFER_USERPTR)
+            dma_unmap_page(
+                buf->device->dev,
+                PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c]),
+                PAGE_SIZE,
+                BUFFER_DMA_DIR(buf)
+            );
+        else
+        {
+            atomic64_sub(PAGE_SIZE, &buf->device->node_used[page_to_nid(buf->pages[buf->page_c])]);
+            put_device_page(
+                buf->device,
+                buf->pages[buf->page_c],
+                PTE_DMA_ADDR(buf->dev_pagetable[buf->page_c])
+            );
+        }
     }
 
-    kfree(buf->usr_pagetable);
+    if (buf->flags & DOOMBUFFER_USERPTR)
+    {
+        // the device may have written to them
+        unpin_user_pages_dirty_lock(buf->pages, n_pages, !(buf->flags & DOOMBUFFER_READONLY));
+        account_locked_vm(buf->mm, n_pages, false);
+        mmdrop(buf->mm);
+    }
 
-    dma_free_coherent(
-        &buf->device->pci_device->dev,
-        PAGE_SIZE,
-        buf->dev_pagetable,
-        buf->dev_pagetable_handle << 8
-    );
+    kfree(buf->pages);
+
+    free_dev_pagetable(buf, n_pages);
 
     kmem_cache_free(doombuffer_cache, buf);
 }
 
 
+// CPU access to a buffer goes between sync_buffer_for_cpu and
+// sync_buffer_cpu_done, which for imported dma-bufs are the begin and end
+// of the exporter's CPU access; the end is due only if the begin succeeded
+int sync_buffer_for_cpu(struct doombuffer* buf, loff_t pos, size_t count)
+{
+    uint32_t page;
+
+    if (count == 0)
+        return 0;
+
+    // the dummy page is shared by every purged buffer of the device, the
+    // contents are gone until WILLNEED
+    if (READ_ONCE(buffer_root(buf)->flags) & DOOMBUFFER_PURGED)
+        return EIO;
+
+    wait_grab(buf);
+
+    if (READ_ONCE(buffer_root(buf)->grab_failed))
+        return EIO;
+
+    if (buffer_root(buf)->flags & DOOMBUFFER_DMABUF)
+        return -dma_buf_begin_cpu_access(buffer_root(buf)->attach->dmabuf, DMA_BIDIRECTIONAL);
+
+    for (page = pos >> PAGE_SHIFT; page <= (pos + count - 1) >> PAGE_SHIFT; page++)
+        dma_sync_single_for_cpu(
+            buf->device->dev,
+            PTE_DMA_ADDR(buf->dev_pagetable[page]),
+            PAGE_SIZE,
+            BUFFER_DMA_DIR(buf)
+        );
+
+    return 0;
+}
+
+
+// written ranges are handed back to the device
+int sync_buffer_cpu_done(struct doombuffer* buf, loff_t pos, size_t count, int written)
+{
+    if (count == 0)
+        return 0;
+
+    if (buffer_root(buf)->flags & DOOMBUFFER_DMABUF)
+        return -dma_buf_end_cpu_access(buffer_root(buf)->attach->dmabuf, DMA_BIDIRECTIONAL);
+
+    if (written)
+        sync_buffer_for_device(buf, pos, count);
+
+    return 0;
+}
+
+
+void sync_buffer_for_device(struct doombuffer* buf, loff_t pos, size_t count)
+{
+    uint32_t page;
+
+    if (count == 0)
+        return;
+
+    // the exporter keeps its pages coherent for the device, CPU writes
+    // are flushed by sync_buffer_cpu_done
+    if (buffer_root(buf)->flags & DOOMBUFFER_DMABUF)
+        return;
+
+    for (page = pos >> PAGE_SHIFT; page <= (pos + count - 1) >> PAGE_SHIFT; page++)
+        dma_sync_single_for_device(
+            buf->device->dev,
+            PTE_DMA_ADDR(buf->dev_pagetable[page]),
+            PAGE_SIZE,
+            BUFFER_DMA_DIR(buf)
+        );
+}
+
+
 static int buffer_release(struct inode *ino, struct file *file)
 {
     free_pagetable(file->private_data);
@@ -141,18 +916,68 @@ static int buffer_release(struct inode *ino, struct file *file)
 }
 
 
-static ssize_t buffer_read(struct file *file, char __user *user_data, size_t count, loff_t *off)
+// the mapping holds a reference on the file, so the pages cannot be purged
+// or recycled under it
+static int buffer_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int err;
+    struct doombuffer* buf = file->private_data;
+    struct doombuffer* root = buffer_root(buf);
+
+    // imported dma-bufs are mapped through their exporter
+    if (buf->pages == NULL || offset_in_page(buf->vaddr) != 0)
+        return -EINVAL;
+
+    if ((root->flags & DOOMBUFFER_READONLY) && (vma->vm_flags & VM_WRITE))
+        return -EPERM;
+
+    mutex_lock(&root->lock);
+
+    if (root->flags & (DOOMBUFFER_DONTNEED|DOOMBUFFER_PURGED))
+    {
+        err = EBUSY;
+        goto err_locked;
+    }
+
+    // stores through the mapping bypass buffer_touch, see ring_bind
+    if (!(root->flags & DOOMBUFFER_READONLY))
+        root->flags |= DOOMBUFFER_EXPORTED;
+    else
+        vm_flags_clear(vma, VM_MAYWRITE);
+
+    mutex_unlock(&root->lock);
+
+    mutex_lock(&buf->lock);
+    if (0 == (err = sync_buffer_for_cpu(buf, 0, buf->size)))
+        sync_buffer_cpu_done(buf, 0, buf->size, 0);
+    mutex_unlock(&buf->lock);
+
+    if (err)
+        return -err;
+
+    return vm_map_pages(vma, buf->pages, buf->page_c);
+
+err_locked:
+    mutex_unlock(&root->lock);
+
+    return -err;
+}
+
+
+static ssize_t buffer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    loff_t start;
     loff_t pos;
-    loff_t end;
+    size_t count;
+    size_t copied;
     struct doombuffer* buf;
     ssize_t ret;
+    int err;
 
-    buf = file->private_data;
+    buf = iocb->ki_filp->private_data;
 
     mutex_lock(&buf->lock);
-    start = pos = *off;
+    pos = iocb->ki_pos;
+    count = iov_iter_count(to);
 
     if (pos < 0 || pos > buf->size)
     {
@@ -162,43 +987,36 @@ static ssize_t buffer_read(struct file *file, char __user *user_data, size_t cou
 
     if (count > buf->size - pos)
         count = buf->size - pos;
-    end = pos + count;
 
-    if (pos == end)
+    if (count == 0)
     {
         ret = 0;
         goto err_end;
     }
 
-    while (pos != end)
+    if ((err = sync_buffer_for_cpu(buf, pos, count)))
     {
-        loff_t copy_end;
-        copy_end = (pos + PAGE_SIZE)&(~(PAGE_SIZE-1));
-        if (copy_end > end)
-            copy_end = end;
+        ret = -err;
+        goto err_end;
+    }
 
-        BUG_ON((pos>>12) >= buf->page_c);
-        BUG_ON((pos & (PAGE_SIZE-1)) + copy_end-pos > 4096);
+    // all segments in one go, a short copy means a fault somewhere on the way
+    copied = copy_to_iter(buf->vaddr + pos, count, to);
 
-        if ((ret = copy_to_user(
-            user_data+pos-start,
-            buf->usr_pagetable[pos>>12]+(pos & (PAGE_SIZE-1)),
-            copy_end-pos
-        )))
-        {
-            *off = pos;
-            if (pos != start)
-                ret = pos-start;
-            else
-                ret = -EFAULT;
-            goto err_end;
-        }
+    if ((err = sync_buffer_cpu_done(buf, pos, count, 0)))
+    {
+        ret = -err;
+        goto err_end;
+    }
 
-        pos = copy_end;
+    if (copied == 0)
+    {
+        ret = -EFAULT;
+        goto err_end;
     }
-    *off = pos;
 
-    ret = pos-start;
+    iocb->ki_pos = pos + copied;
+    ret = copied;
 
 err_end:
     mutex_unlock(&buf->lock);
@@ -206,19 +1024,23 @@ err_end:
 }
 
 
-static ssize_t buffer_write(struct file *file, const char __user *user_data, size_t count, loff_t *off)
+static ssize_t buffer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    loff_t start;
     loff_t pos;
-    loff_t end;
+    size_t count;
+    size_t copied;
     struct doombuffer* buf;
     ssize_t ret;
+    int err;
 
-    buf = file->private_data;
+    buf = iocb->ki_filp->private_data;
 
-    mutex_lock(&buf->lock);
+    if (buffer_root(buf)->flags & DOOMBUFFER_READONLY)
+        return -EPERM;
 
-    start = pos = *off;
+    mutex_lock(&buf->lock);
+    pos = iocb->ki_pos;
+    count = iov_iter_count(from);
 
     if (pos < 0 || pos > buf->size)
     {
@@ -228,46 +1050,38 @@ static ssize_t buffer_write(struct file *file, const char __user *user_data, siz
 
     if (count > buf->size - pos)
         count = buf->size - pos;
-    end = pos + count;
 
-    if (pos == end)
+    if (count == 0)
     {
         ret = -EFAULT;
         goto err_end;
     }
 
-    while (pos != end)
+    if ((err = sync_buffer_for_cpu(buf, pos, count)))
     {
-        loff_t copy_end;
-        copy_end = (pos + PAGE_SIZE)&(~(PAGE_SIZE-1));
-        if (copy_end > end)
-            copy_end = end;
+        ret = -err;
+        goto err_end;
+    }
 
-        BUG_ON((pos>>12) >= buf->page_c);
-        BUG_ON((pos & (PAGE_SIZE-1)) + copy_end-pos > 4096);
+    copied = copy_from_iter(buf->vaddr + pos, count, from);
 
-        if (copy_from_user(
-            buf->usr_pagetable[pos>>12]+(pos & (PAGE_SIZE-1)),
-            user_data+pos-start,
-            copy_end-pos
-        ))
-        {
-            *off = pos;
-            if (pos != start)
-                ret = pos-start;
-            else
-                ret = -EFAULT;
-            goto err_end;
-        }
+    err = sync_buffer_cpu_done(buf, pos, count, 1);
+    buffer_touch(buf);
 
-        pos = copy_end;
+    if (err)
+    {
+        ret = -err;
+        goto err_end;
     }
-    *off = pos;
 
-    ret = pos-start;
+    if (copied == 0)
+    {
+        ret = -EFAULT;
+        goto err_end;
+    }
 
-    mutex_unlock(&buf->lock);
-    return ret;
+    iocb->ki_pos = pos + copied;
+    ret = copied;
 
 err_end:
     mutex_unlock(&buf->lock);
@@ -303,3 +1117,290 @@ static loff_t buffer_llseek(struct file *file, loff_t filepos, int whence)
     mutex_unlock(&buf->lock);
     return pos;
 }
+
+
+int load_buffer_from_file(struct doombuffer* buf, uint32_t offset, struct file* file, loff_t pos, uint32_t size)
+{
+    int err;
+    ssize_t ret;
+    uint32_t done;
+
+    if (buffer_root(buf)->flags & DOOMBUFFER_READONLY)
+        return EPERM;
+
+    if (offset > buf->size || size > buf->size - offset)
+        return EINVAL;
+
+    mutex_lock(&buf->lock);
+    if ((err = sync_buffer_for_cpu(buf, offset, size)))
+    {
+        mutex_unlock(&buf->lock);
+        return err;
+    }
+
+    // straight from the page cache into the buffer, no bounce through the user
+    for (done = 0; done < size; done += ret)
+    {
+        if ((ret = kernel_read(file, buf->vaddr + offset + done, size - done, &pos)) <= 0)
+        {
+            // the file ended before the requested range did
+            err = ret < 0 ? -ret : EIO;
+            break;
+        }
+    }
+
+    ret = sync_buffer_cpu_done(buf, offset, size, 1);
+    if (err == 0)
+        err = ret;
+    buffer_touch(buf);
+    mutex_unlock(&buf->lock);
+
+    return err;
+}
+
+
+int copy_surface_rect(struct doombuffer* buf, const struct doomdev2_ioctl_surface_rect* rect, int to_user)
+{
+    int err;
+    uint32_t row;
+    loff_t first;
+    size_t span;
+    uint64_t extent;
+    uint8_t __user* data;
+    int done;
+
+    // only surfaces have rows, the rectangle has to fit inside
+    if (
+        buf->width == 0 ||
+        rect->width == 0 || rect->height == 0 ||
+        rect->pos_x + rect->width > buf->width ||
+        rect->pos_y + rect->height > buf->height ||
+        rect->stride < rect->width
+    )
+        return EINVAL;
+
+    // user memory from the first to the last byte of the rectangle, which
+    // has to be addressable as a whole
+    extent = (uint64_t)(rect->height-1)*rect->stride + rect->width;
+    if (extent > ULONG_MAX || rect->data + extent < rect->data)
+        return EINVAL;
+
+    if (!to_user && (buffer_root(buf)->flags & DOOMBUFFER_READONLY))
+        return EPERM;
+
+    data = u64_to_user_ptr(rect->data);
+    first = rect->pos_y*buf->width + rect->pos_x;
+    span = (rect->height-1)*buf->width + rect->width;
+
+    mutex_lock(&buf->lock);
+    if ((err = sync_buffer_for_cpu(buf, first, span)))
+    {
+        mutex_unlock(&buf->lock);
+        return err;
+    }
+
+    for (row = 0; row < rect->height; row++)
+    {
+        uint8_t* line = buf->vaddr + first + row*buf->width;
+        uint8_t __user* user_line = data + (unsigned long)row*rect->stride;
+
+        if (to_user ?
+            copy_to_user(user_line, line, rect->width) :
+            copy_from_user(line, user_line, rect->width)
+        )
+        {
+            err = EFAULT;
+            break;
+        }
+    }
+
+    done = sync_buffer_cpu_done(buf, first, span, !to_user);
+    if (err == 0)
+        err = done;
+    if (!to_user)
+        buffer_touch(buf);
+    mutex_unlock(&buf->lock);
+
+    return err;
+}
+
+
+// the device may only be handed buffers the shrinker will not purge; one
+// marked DONTNEED later is still safe while the caller holds its file
+int buffer_device_usable(struct doombuffer* buf)
+{
+    struct doombuffer* root = buffer_root(buf);
+    int usable;
+
+    mutex_lock(&root->lock);
+    usable = !(root->flags & DOOMBUFFER_DONTNEED);
+    mutex_unlock(&root->lock);
+
+    return usable;
+}
+
+
+// gives a purged buffer fresh, zeroed pages; caller holds the buffer lock
+static int restore_buffer(struct doombuffer* buf)
+{
+    int err;
+    struct doomdevice* device = buf->device;
+    dma_addr_t temp_handle;
+    uint8_t* vaddr;
+    uint32_t i;
+
+    for (i = 0; i < buf->page_c; i++)
+    {
+        struct page* page;
+
+        if (0 == (page = get_device_page(device, device->node, &temp_handle)))
+        {
+            err = ENOMEM;
+            goto err_alloc_pages;
+        }
+
+        buf->pages[i] = page;
+        buf->dev_pagetable[i] = HARDDOOM2_PTE_VALID|HARDDOOM2_PTE_WRITABLE | (temp_handle >> 8);
+        atomic64_add(PAGE_SIZE, &device->node_used[page_to_nid(page)]);
+    }
+
+    if (0 == (vaddr = vmap(buf->pages, buf->page_c, VM_MAP, PAGE_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_pages;
+    }
+
+    buf->vaddr = vaddr;
+    atomic64_add(buf->page_c*PAGE_SIZE, &device->mem_used);
+    buf->flags &= ~DOOMBUFFER_PURGED;
+    buf->pt_gen = next_gen(device);
+
+    return 0;
+
+err_alloc_pages:
+    while (i)
+    {
+        i--;
+        atomic64_sub(PAGE_SIZE, &device->node_used[page_to_nid(buf->pages[i])]);
+        put_device_page(device, buf->pages[i], PTE_DMA_ADDR(buf->dev_pagetable[i]));
+        buf->pages[i] = device->dummy_page;
+        buf->dev_pagetable[i] = HARDDOOM2_PTE_VALID | (device->dummy_handle >> 8);
+    }
+
+    return err;
+}
+
+
+static int madvise_buffer(struct doombuffer* buf, uint32_t advice, uint32_t* retained)
+{
+    int err = 0;
+    struct doomdevice* device = buf->device;
+
+    // only buffers owning their pages can give them back
+    if (buf->parent != NULL || (buf->flags & (DOOMBUFFER_USERPTR|DOOMBUFFER_DMABUF|DOOMBUFFER_READONLY)))
+        return EINVAL;
+
+    if (advice != DOOMDEV2_MADV_WILLNEED && advice != DOOMDEV2_MADV_DONTNEED)
+        return EINVAL;
+
+    mutex_lock(&buf->lock);
+
+    *retained = !(buf->flags & DOOMBUFFER_PURGED);
+
+    if (advice == DOOMDEV2_MADV_DONTNEED && !(buf->flags & DOOMBUFFER_DONTNEED))
+    {
+        buf->flags |= DOOMBUFFER_DONTNEED;
+        mutex_lock(&device->purge_lock);
+        list_add_tail(&buf->purge_node, &device->purgeable);
+        device->purgeable_c += buf->page_c;
+        mutex_unlock(&device->purge_lock);
+    }
+
+    if (advice == DOOMDEV2_MADV_WILLNEED && (buf->flags & DOOMBUFFER_DONTNEED))
+    {
+        if ((buf->flags & DOOMBUFFER_PURGED) && (err = restore_buffer(buf)))
+            goto err_end;
+
+        mutex_lock(&device->purge_lock);
+        if (!list_empty(&buf->purge_node))
+        {
+            list_del_init(&buf->purge_node);
+            device->purgeable_c -= buf->page_c;
+        }
+        mutex_unlock(&device->purge_lock);
+        buf->flags &= ~DOOMBUFFER_DONTNEED;
+    }
+
+err_end:
+    mutex_unlock(&buf->lock);
+
+    return err;
+}
+
+
+static long buffer_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct doombuffer* buf;
+
+    buf = file->private_data;
+
+    switch (cmd)
+    {
+        case DOOMDEV2_IOCTL_READ_RECT:
+        case DOOMDEV2_IOCTL_WRITE_RECT:
+        {
+            struct doomdev2_ioctl_surface_rect ioctl_rect;
+            if (copy_from_user(
+                &ioctl_rect,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_surface_rect)
+            ))
+                return -EFAULT;
+
+            return -copy_surface_rect(buf, &ioctl_rect, cmd == DOOMDEV2_IOCTL_READ_RECT);
+        }
+        case DOOMDEV2_IOCTL_EXPORT_DMABUF:
+        {
+            uint32_t flags;
+            if (copy_from_user(
+                &flags,
+                (const void __user *)arg,
+                sizeof(uint32_t)
+            ))
+                return -EFAULT;
+
+            if ((flags & ~DOOMDEV2_DMABUF_CLOEXEC) != 0)
+                return -EINVAL;
+
+            if (!buffer_device_usable(buf))
+                return -EBUSY;
+
+            return export_buffer_dmabuf(buf, flags);
+        }
+        case DOOMDEV2_IOCTL_MADVISE:
+        {
+            struct doomdev2_ioctl_madvise ioctl_madvise;
+            int err;
+            if (copy_from_user(
+                &ioctl_madvise,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_madvise)
+            ))
+                return -EFAULT;
+
+            if ((err = madvise_buffer(buf, ioctl_madvise.advice, &ioctl_madvise.retained)))
+                return -err;
+
+            if (copy_to_user(
+                (void __user *)arg,
+                &ioctl_madvise,
+                sizeof(struct doomdev2_ioctl_madvise)
+            ))
+                return -EFAULT;
+
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+    }
+}
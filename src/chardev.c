@@ -8,14 +8,18 @@
 #include <linux/anon_inodes.h>
 #include <linux/uaccess.h>
 #include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
 
 static dev_t doom_major;
 
 static struct cdev doom_cdev;
+static struct device* doom_any;
 
 static struct class doom_class = {
     .name = "doomdev",
-    .owner = THIS_MODULE,
 };
 
 static int doom_open(struct inode *ino, struct file *file);
@@ -23,7 +27,7 @@ static int doom_release(struct inode *ino, struct file *file);
 static ssize_t doom_write(struct file *file, const char __user *user_data, size_t size, loff_t *off);
 static long doom_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
-static struct file_operations doom_fops = {
+struct file_operations doom_fops = {
     .owner = THIS_MODULE,
     .open = doom_open,
     .write = doom_write,
@@ -50,10 +54,23 @@ static int doom_open(struct inode *ino, struct file *file)
     }
 
     *df = aux; // zero everything. df->buffers == 0
-    df->device = devices[MINOR(ino->i_rdev)];
     mutex_init(&df->lock);
 
-    if (0 == (df->raw_cmds = vmalloc(sizeof(struct doomdev2_cmd)*DOOMDEV_MAX_CMD_COUNT)))
+    if (MINOR(ino->i_rdev) == DOOM_ANY_MINOR)
+    {
+        df->any = 1;
+        df->device = pick_device(NUMA_NO_NODE);
+    }
+    else
+        df->device = get_device_context(MINOR(ino->i_rdev));
+
+    if (df->device == NULL)
+    {
+        err = ENODEV;
+        goto err_no_device;
+    }
+
+    if (0 == (df->raw_cmds = vmalloc_node(sizeof(struct doomdev2_cmd)*DOOMDEV_MAX_CMD_COUNT, df->device->node)))
     {
         err = ENOMEM;
         goto err_rawcmd_alloc;
@@ -66,10 +83,13 @@ static int doom_open(struct inode *ino, struct file *file)
     vfree(df->raw_cmds);
 err_rawcmd_alloc:
 
+    put_device_context(df->device);
+err_no_device:
+
     kmem_cache_free(doomfile_cache, df);
 err_cache_alloc:
 
-    return err;
+    return -err;
 }
 
 
@@ -84,110 +104,1046 @@ static int doom_release(struct inode *ino, struct file *file)
         if (df->buffers.array[i] != 0)
             fput(df->buffers.array[i]->file);
 
+    clear_split(df);
+    release_shadows(df);
+    put_device_context(df->device);
     vfree(df->raw_cmds);
     kmem_cache_free(doomfile_cache, df);
     return 0;
 }
 
 
-static int alloc_buffer_inode(struct doomfile* df, uint32_t size, uint32_t width, uint32_t height)
+// on success the file owns the buffer
+struct file* open_buffer_file(struct doombuffer* buf)
+{
+    struct file* file;
+
+    if (IS_ERR(file = anon_inode_getfile("doom_buffer", &buffer_fops, buf, O_RDWR)))
+        return file;
+
+    file->f_mode |= FMODE_LSEEK | FMODE_PREAD | FMODE_PWRITE;
+    buf->file = file;
+
+    return file;
+}
+
+
+static int install_buffer_inode(struct doombuffer* buf)
 {
     int err;
-    struct doombuffer* buf;
     struct file* file;
     int fd;
 
-    if (IS_ERR(buf = alloc_pagetable(df->device, size, width, height)))
+    if ((fd = get_unused_fd_flags(O_RDWR)) < 0)
+    {
+        err = -fd;
+        goto err_get_fd;
+    }
+
+    if (IS_ERR(file = open_buffer_file(buf)))
+    {
+        err = -PTR_ERR(file);
+        goto err_file;
+    }
+
+    fd_install(fd, file);
+
+    return fd;
+
+err_file:
+
+    put_unused_fd(fd);
+err_get_fd:
+
+    free_pagetable(buf);
+
+    return -err;
+}
+
+
+static int alloc_buffer_inode(struct doomfile* df, uint32_t size, uint32_t width, uint32_t height, int node)
+{
+    struct doombuffer* buf;
+
+    if (IS_ERR(buf = alloc_pagetable(df->device, size, width, height, node)))
+        return PTR_ERR(buf);
+
+    return install_buffer_inode(buf);
+}
+
+
+static int alloc_view_inode(struct doomfile* df, int32_t fd, uint32_t offset, uint32_t size)
+{
+    int err;
+    struct file* src_file;
+    struct doombuffer* src;
+    struct doombuffer* buf;
+
+    if ((src_file = fget(fd)) == NULL)
+        return -EBADF;
+
+    src = src_file->private_data;
+
+    if (src_file->f_op != &buffer_fops || src->device != df->device)
+    {
+        err = EINVAL;
+        goto err_end;
+    }
+
+    if ((offset & (PAGE_SIZE-1)) != 0 || size == 0 || offset >= src->size || size > src->size - offset)
+    {
+        err = EINVAL;
+        goto err_end;
+    }
+
+    // its mappings belong to the attached buffer, which a view would not
+    // keep alive
+    if (src->flags & DOOMBUFFER_ATTACHED)
+    {
+        err = EINVAL;
+        goto err_end;
+    }
+
+    if (!buffer_device_usable(src))
+    {
+        err = EBUSY;
+        goto err_end;
+    }
+
+    if (IS_ERR(buf = alloc_view(src, offset, size)))
     {
-        err = PTR_ERR(buf);
-        goto err_alloc_pagetable;
+        err = -PTR_ERR(buf);
+        goto err_end;
     }
 
-    if ((fd = get_unused_fd_flags(O_RDWR)) < 0)
-    {
-        err = -fd;
-        goto err_get_fd;
-    }
+    fput(src_file);
+    return install_buffer_inode(buf);
+
+err_end:
+    fput(src_file);
+    return -err;
+}
+
+
+static int attach_buffer_inode(struct doomfile* df, int32_t fd)
+{
+    int err;
+    struct file* src_file;
+    struct doombuffer* src;
+    struct doombuffer* buf;
+
+    if ((src_file = fget(fd)) == NULL)
+        return -EBADF;
+
+    src = src_file->private_data;
+
+    // imported dma-bufs have no pages to map again
+    if (src_file->f_op != &buffer_fops || src->device == df->device || src->pages == NULL)
+    {
+        err = EINVAL;
+        goto err_end;
+    }
+
+    if (!buffer_device_usable(src))
+    {
+        err = EBUSY;
+        goto err_end;
+    }
+
+    if (IS_ERR(buf = alloc_attached(df->device, src)))
+    {
+        err = -PTR_ERR(buf);
+        goto err_end;
+    }
+
+    fput(src_file);
+    return install_buffer_inode(buf);
+
+err_end:
+    fput(src_file);
+    return -err;
+}
+
+
+static int load_buffers(struct doomfile* df, const struct doomdev2_ioctl_load* load)
+{
+    int err;
+    uint32_t i;
+    struct doomdev2_load_entry entry;
+    struct doomdev2_load_entry __user* entries;
+
+    entries = u64_to_user_ptr(load->entries);
+
+    for (i = 0; i < load->count; i++)
+    {
+        struct file* src_file;
+        struct file* buf_file;
+
+        if (copy_from_user(&entry, entries + i, sizeof(struct doomdev2_load_entry)))
+            return EFAULT;
+
+        if ((src_file = fget(entry.file_fd)) == NULL)
+            return EBADF;
+
+        if ((buf_file = fget(entry.buffer_fd)) == NULL)
+        {
+            fput(src_file);
+            return EBADF;
+        }
+
+        // reading a doombuffer would take its lock under the lock of the
+        // destination; buffer to buffer copies go through the blit ioctl
+        if (buf_file->f_op != &buffer_fops || src_file->f_op == &buffer_fops || !(src_file->f_mode & FMODE_READ))
+            err = EINVAL;
+        else
+            err = load_buffer_from_file(
+                buf_file->private_data,
+                entry.buffer_offset,
+                src_file,
+                entry.file_offset,
+                entry.size
+            );
+
+        fput(buf_file);
+        fput(src_file);
+
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+
+static int read_rects(struct doomfile* df, const struct doomdev2_ioctl_read_rects* read)
+{
+    int err;
+    uint32_t i;
+    struct doomdev2_read_rect_entry entry;
+    struct doomdev2_read_rect_entry __user* entries;
+
+    entries = u64_to_user_ptr(read->entries);
+
+    ring_quiesce(df->device);
+
+    for (i = 0; i < read->count; i++)
+    {
+        struct file* buf_file;
+        struct doombuffer* buf;
+
+        if (copy_from_user(&entry, entries + i, sizeof(struct doomdev2_read_rect_entry)))
+            return EFAULT;
+
+        if ((buf_file = fget(entry.surface_fd)) == NULL)
+            return EBADF;
+
+        buf = buf_file->private_data;
+
+        if (buf_file->f_op != &buffer_fops || buf->device != df->device)
+            err = EINVAL;
+        else
+            err = copy_surface_rect(buf, &entry.rect, 1);
+
+        fput(buf_file);
+
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+
+// width 0 describes a plain buffer, otherwise a surface
+static int check_create_args(uint32_t size, uint32_t width, uint32_t height)
+{
+    if (width == 0)
+        return OOBOUNDS(1, 2048*2048, size) ? EINVAL : 0;
+
+    if (OOBOUNDS(1, 2048, width) || OOBOUNDS(1, 2048, height) || (width&63) != 0)
+        return EINVAL;
+
+    return 0;
+}
+
+
+// all or nothing: fds are only installed once every buffer has been
+// allocated, filled and its fd reported back to the user
+static int create_buffers(struct doomfile* df, const struct doomdev2_ioctl_create_batch* batch)
+{
+    int err;
+    uint32_t i;
+    uint32_t done;
+    struct doomdev2_create_entry* entries;
+    struct doomdev2_create_entry __user* user_entries;
+    struct file** files;
+
+    user_entries = u64_to_user_ptr(batch->entries);
+
+    if (OOBOUNDS(1, DOOMDEV2_CREATE_BATCH_MAX, batch->count))
+        return EINVAL;
+
+    if (0 == (entries = kvmalloc_array(batch->count, sizeof(struct doomdev2_create_entry), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_entries;
+    }
+
+    if (0 == (files = kvcalloc(batch->count, sizeof(struct file*), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_files;
+    }
+
+    if (copy_from_user(entries, user_entries, batch->count*sizeof(struct doomdev2_create_entry)))
+    {
+        err = EFAULT;
+        goto err_copy_entries;
+    }
+
+    for (i = 0; i < batch->count; i++)
+    {
+        if ((err = check_create_args(entries[i].size, entries[i].width, entries[i].height)))
+            goto err_copy_entries;
+    }
+
+    for (done = 0; done < batch->count; done++)
+    {
+        struct doomdev2_create_entry* entry = &entries[done];
+        struct doombuffer* buf;
+        uint32_t size;
+
+        size = entry->width != 0 ? entry->width*entry->height : entry->size;
+
+        if (IS_ERR(buf = alloc_pagetable(df->device, size, entry->width, entry->height, NUMA_NO_NODE)))
+        {
+            err = -PTR_ERR(buf);
+            goto err_create;
+        }
+
+        if (IS_ERR(files[done] = open_buffer_file(buf)))
+        {
+            err = -PTR_ERR(files[done]);
+            free_pagetable(buf);
+            goto err_create;
+        }
+
+        if (entry->data != 0)
+        {
+            if (copy_from_user(buf->vaddr, u64_to_user_ptr(entry->data), size))
+            {
+                err = EFAULT;
+                done++;
+                goto err_create;
+            }
+            sync_buffer_for_device(buf, 0, size);
+        }
+
+        entry->fd = -1;
+    }
+
+    for (i = 0; i < batch->count; i++)
+    {
+        if ((entries[i].fd = get_unused_fd_flags(O_RDWR)) < 0)
+        {
+            err = -entries[i].fd;
+            goto err_get_fd;
+        }
+    }
+
+    if (copy_to_user(user_entries, entries, batch->count*sizeof(struct doomdev2_create_entry)))
+    {
+        err = EFAULT;
+        goto err_get_fd;
+    }
+
+    for (i = 0; i < batch->count; i++)
+        fd_install(entries[i].fd, files[i]);
+
+    kvfree(files);
+    kvfree(entries);
+
+    return 0;
+
+err_get_fd:
+    for (i = 0; i < batch->count && entries[i].fd >= 0; i++)
+        put_unused_fd(entries[i].fd);
+err_create:
+
+    // releasing the files frees their buffers
+    for (i = 0; i < done; i++)
+        fput(files[i]);
+err_copy_entries:
+
+    kvfree(files);
+err_alloc_files:
+
+    kvfree(entries);
+err_alloc_entries:
+
+    return err;
+}
+
+
+// looks up count buffer fds of the device, references end up in files
+static int get_buffer_files(struct doomfile* df, const int32_t* fds, uint32_t count, struct file** files)
+{
+    int err;
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((files[i] = fget(fds[i])) == NULL)
+        {
+            err = EBADF;
+            goto err_fget;
+        }
+
+        if (files[i]->f_op != &buffer_fops || ((struct doombuffer*)files[i]->private_data)->device != df->device)
+        {
+            fput(files[i]);
+            err = EINVAL;
+            goto err_fget;
+        }
+    }
+
+    return 0;
+
+err_fget:
+    while (i)
+        fput(files[--i]);
+
+    return err;
+}
+
+
+// the fd of the snapshot is stored in fd
+static int snapshot_buffers(struct doomfile* df, const struct doomdev2_ioctl_snapshot* snapshot, int* fd)
+{
+    int err;
+    uint32_t i;
+    int32_t* fds;
+    struct file** files;
+    struct doombuffer** buffers;
+    struct doomsnapshot* snap;
+
+    if (OOBOUNDS(1, DOOMDEV2_CREATE_BATCH_MAX, snapshot->count))
+        return EINVAL;
+
+    if (0 == (fds = kvmalloc_array(snapshot->count, sizeof(int32_t) + sizeof(struct file*) + sizeof(struct doombuffer*), GFP_KERNEL)))
+        return ENOMEM;
+    files = (struct file**)(fds + snapshot->count);
+    buffers = (struct doombuffer**)(files + snapshot->count);
+
+    if (copy_from_user(fds, u64_to_user_ptr(snapshot->buffer_fds), snapshot->count*sizeof(int32_t)))
+    {
+        err = EFAULT;
+        goto err_copy_fds;
+    }
+
+    if ((err = get_buffer_files(df, fds, snapshot->count, files)))
+        goto err_copy_fds;
+
+    for (i = 0; i < snapshot->count; i++)
+        buffers[i] = files[i]->private_data;
+
+    if (IS_ERR(snap = take_snapshot(df->device, buffers, snapshot->count)))
+    {
+        err = -PTR_ERR(snap);
+        goto err_snapshot;
+    }
+
+    if ((*fd = anon_inode_getfd("doom_snapshot", &snapshot_fops, snap, O_RDONLY)) < 0)
+    {
+        err = -*fd;
+        free_snapshot(snap);
+        goto err_snapshot;
+    }
+
+    for (i = 0; i < snapshot->count; i++)
+        fput(files[i]);
+    kvfree(fds);
+
+    return 0;
+
+err_snapshot:
+    for (i = 0; i < snapshot->count; i++)
+        fput(files[i]);
+err_copy_fds:
+
+    kvfree(fds);
+
+    return err;
+}
+
+
+// buffers given as -1 are created anew; their fds are only installed once
+// everything has been restored
+static int restore_buffers(struct doomfile* df, const struct doomdev2_ioctl_restore* restore)
+{
+    int err;
+    uint32_t i;
+    int32_t* fds;
+    int32_t* new_fds;
+    struct file** files;
+    struct file* snap_file;
+    struct doomsnapshot* snap;
+    int32_t __user* user_fds;
+
+    user_fds = u64_to_user_ptr(restore->buffer_fds);
+
+    if ((snap_file = fget(restore->snapshot_fd)) == NULL)
+        return EBADF;
+
+    snap = snap_file->private_data;
+
+    if (snap_file->f_op != &snapshot_fops || snap->device != df->device || restore->count != snap->count)
+    {
+        err = EINVAL;
+        goto err_snapshot;
+    }
+
+    if (0 == (fds = kvmalloc_array(snap->count, 2*sizeof(int32_t) + sizeof(struct file*), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_snapshot;
+    }
+    new_fds = fds + snap->count;
+    files = (struct file**)(new_fds + snap->count);
+
+    if (copy_from_user(fds, user_fds, snap->count*sizeof(int32_t)))
+    {
+        err = EFAULT;
+        goto err_copy_fds;
+    }
+
+    for (i = 0; i < snap->count; i++)
+    {
+        struct doomsnapshot_entry* entry = &snap->entries[i];
+        struct doombuffer* buf;
+
+        new_fds[i] = -1;
+
+        if (fds[i] >= 0)
+        {
+            if ((err = get_buffer_files(df, &fds[i], 1, &files[i])))
+                goto err_get_files;
+            continue;
+        }
+
+        if (IS_ERR(buf = alloc_pagetable(df->device, entry->size, entry->width, entry->height, NUMA_NO_NODE)))
+        {
+            err = -PTR_ERR(buf);
+            goto err_get_files;
+        }
+
+        if (IS_ERR(files[i] = open_buffer_file(buf)))
+        {
+            err = -PTR_ERR(files[i]);
+            free_pagetable(buf);
+            goto err_get_files;
+        }
+    }
+
+    for (i = 0; i < snap->count; i++)
+        if ((err = restore_snapshot_entry(&snap->entries[i], files[i]->private_data)))
+            goto err_restore;
+
+    for (i = 0; i < snap->count; i++)
+    {
+        if (fds[i] >= 0)
+            continue;
+
+        if ((new_fds[i] = get_unused_fd_flags(O_RDWR)) < 0)
+        {
+            err = -new_fds[i];
+            goto err_get_fd;
+        }
+        fds[i] = new_fds[i];
+    }
+
+    if (copy_to_user(user_fds, fds, snap->count*sizeof(int32_t)))
+    {
+        err = EFAULT;
+        goto err_get_fd;
+    }
+
+    for (i = 0; i < snap->count; i++)
+    {
+        if (new_fds[i] >= 0)
+            fd_install(new_fds[i], files[i]);
+        else
+            fput(files[i]);
+    }
+
+    kvfree(fds);
+    fput(snap_file);
+
+    return 0;
+
+err_get_fd:
+    for (i = 0; i < snap->count; i++)
+        if (new_fds[i] >= 0)
+            put_unused_fd(new_fds[i]);
+err_restore:
+
+    i = snap->count;
+err_get_files:
+    // releasing the files of new buffers frees them
+    while (i)
+        fput(files[--i]);
+err_copy_fds:
+
+    kvfree(fds);
+err_snapshot:
+
+    fput(snap_file);
+
+    return err;
+}
+
+
+static int create_shared_inode(struct doomfile* df, const struct doomdev2_ioctl_create_shared* create)
+{
+    int err;
+    uint32_t size;
+    struct doombuffer* root;
+    struct doombuffer* buf;
+
+    if ((err = check_create_args(create->size, create->width, create->height)))
+        return -err;
+
+    size = create->width != 0 ? create->width*create->height : create->size;
+
+    if (IS_ERR(root = get_shared_buffer(df->device, u64_to_user_ptr(create->data), size, create->width, create->height)))
+        return PTR_ERR(root);
+
+    // every user gets its own view, the last one to go drops the entry
+    if (IS_ERR(buf = alloc_view(root, 0, size)))
+    {
+        put_shared_buffer(root);
+        return PTR_ERR(buf);
+    }
+    buf->flags |= DOOMBUFFER_SHARED;
+
+    return install_buffer_inode(buf);
+}
+
+
+// src_fd < 0 fills the destination with value instead
+static int blit_buffers(struct doomfile* df, int32_t src_fd, uint32_t src_offset,
+    int32_t dst_fd, uint32_t dst_offset, uint32_t size, uint8_t value)
+{
+    int err;
+    struct file* src_file = NULL;
+    struct file* dst_file;
+    struct doombuffer* src = NULL;
+    struct doombuffer* dst;
+
+    if ((dst_file = fget(dst_fd)) == NULL)
+        return -EBADF;
+
+    if (src_fd >= 0 && (src_file = fget(src_fd)) == NULL)
+    {
+        err = EBADF;
+        goto err_src_fget;
+    }
+
+    dst = dst_file->private_data;
+    if (src_file != NULL)
+        src = src_file->private_data;
+
+    if (dst_file->f_op != &buffer_fops || dst->device != df->device ||
+        (src_file != NULL && (src_file->f_op != &buffer_fops || src->device != df->device)))
+    {
+        err = EINVAL;
+        goto err_end;
+    }
+
+    if (!buffer_device_usable(dst) || (src != NULL && !buffer_device_usable(src)))
+    {
+        err = EBUSY;
+        goto err_end;
+    }
+
+    err = blit_buffer_range(src, src_offset, dst, dst_offset, size, value);
+
+err_end:
+    if (src_file != NULL)
+        fput(src_file);
+err_src_fget:
+
+    fput(dst_file);
+
+    return -err;
+}
+
+
+// moves a /dev/doom-any context that has not used its device yet
+static int set_affinity(struct doomfile* df, int32_t node)
+{
+    int err = 0;
+    struct doomdevice* device;
+
+    if (node == DOOMDEV2_AFFINITY_LOCAL)
+        node = numa_node_id();
+
+    if (!df->any || (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node))))
+        return EINVAL;
+
+    mutex_lock(&df->lock);
+
+    if (df->placed)
+    {
+        err = EBUSY;
+        goto err_end;
+    }
+
+    if ((device = pick_device(node)) == NULL)
+    {
+        err = ENODEV;
+        goto err_end;
+    }
+
+    put_device_context(df->device);
+    df->device = device;
+
+err_end:
+    mutex_unlock(&df->lock);
+
+    return err;
+}
+
+
+static long doom_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int err;
+    struct doomfile* df;
+    uint32_t size, width, height;
+
+    df = file->private_data;
+
+    // anything but the affinity pins the context to its device; set_affinity
+    // moves it under the context lock, so once placed is set there,
+    // df->device stays as it is for the rest of the ioctl
+    if (cmd != DOOMDEV2_IOCTL_SET_AFFINITY)
+    {
+        mutex_lock(&df->lock);
+        df->placed = 1;
+        mutex_unlock(&df->lock);
+    }
+
+    switch(cmd)
+    {
+        case DOOMDEV2_IOCTL_SET_AFFINITY:
+        {
+            int32_t node;
+            if (copy_from_user(
+                &node,
+                (const void __user *)arg,
+                sizeof(int32_t)
+            ))
+                return -EFAULT;
+
+            return -set_affinity(df, node);
+        }
+        case DOOMDEV2_IOCTL_SET_SPLIT:
+        {
+            struct doomdev2_ioctl_set_split ioctl_split;
+            int32_t fds[DOOMDEV2_SPLIT_MAX];
+            if (copy_from_user(
+                &ioctl_split,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_set_split)
+            ))
+                return -EFAULT;
+
+            if (ioctl_split.count > DOOMDEV2_SPLIT_MAX)
+                return -EINVAL;
+
+            if (copy_from_user(
+                fds,
+                u64_to_user_ptr(ioctl_split.context_fds),
+                sizeof(int32_t)*ioctl_split.count
+            ))
+                return -EFAULT;
+
+            return -set_split(df, fds, ioctl_split.count);
+        }
+        case DOOMDEV2_IOCTL_GRAB_FRAME:
+        {
+            int32_t fd;
+            if (copy_from_user(
+                &fd,
+                (const void __user *)arg,
+                sizeof(int32_t)
+            ))
+                return -EFAULT;
+
+            mutex_lock(&df->lock);
+            err = grab_frame(df, fd);
+            mutex_unlock(&df->lock);
+
+            return err;
+        }
+        case DOOMDEV2_IOCTL_CREATE_SURFACE:
+        {
+            struct doomdev2_ioctl_create_surface ioctl_surf;
+            if (copy_from_user(
+                &ioctl_surf,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_create_surface)
+            ))
+                return -EFAULT;
+            size = ioctl_surf.width*ioctl_surf.height;
+            width = ioctl_surf.width;
+            height = ioctl_surf.height;
+
+            if (size > 2048*2048)
+                return -EOVERFLOW;
+
+            if (
+                OOBOUNDS(1, 2048, width) ||
+                OOBOUNDS(1, 2048, height) ||
+                ((width&63) != 0)
+            )
+                return -EINVAL;
+            return alloc_buffer_inode(df, size, width, height, NUMA_NO_NODE);
+        }
+        case DOOMDEV2_IOCTL_CREATE_BUFFER:
+        {
+            struct doomdev2_ioctl_create_buffer ioctl_buffer;
+            if (copy_from_user(
+                &ioctl_buffer,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_create_buffer)
+            ))
+                return -EFAULT;
+
+            size = ioctl_buffer.size;
+            width = 0;
+            height = 0;
+
+            if (size > 2048*2048)
+                return -EOVERFLOW;
+
+            if (OOBOUNDS(1, 2048*2048, size))
+                return -EINVAL;
+
+            return alloc_buffer_inode(df, size, width, height, NUMA_NO_NODE);
+        }
+        case DOOMDEV2_IOCTL_CREATE_ON_NODE:
+        {
+            struct doomdev2_ioctl_create_on_node ioctl_node;
+            if (copy_from_user(
+                &ioctl_node,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_create_on_node)
+            ))
+                return -EFAULT;
+
+            width = ioctl_node.width;
+            height = ioctl_node.height;
+            size = width != 0 ? width*height : ioctl_node.size;
+
+            if (size > 2048*2048)
+                return -EOVERFLOW;
+
+            if (width == 0 ? (height != 0 || OOBOUNDS(1, 2048*2048, size)) : (
+                OOBOUNDS(1, 2048, width) ||
+                OOBOUNDS(1, 2048, height) ||
+                ((width&63) != 0)
+            ))
+                return -EINVAL;
+
+            if (ioctl_node.node != NUMA_NO_NODE &&
+                (ioctl_node.node < 0 || ioctl_node.node >= nr_node_ids || !node_online(ioctl_node.node)))
+                return -EINVAL;
+
+            return alloc_buffer_inode(df, size, width, height, ioctl_node.node);
+        }
+        case DOOMDEV2_IOCTL_CREATE_USERPTR:
+        {
+            struct doomdev2_ioctl_create_userptr ioctl_userptr;
+            struct doombuffer* buf;
+            if (copy_from_user(
+                &ioctl_userptr,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_create_userptr)
+            ))
+                return -EFAULT;
+
+            if (OOBOUNDS(1, 2048*2048, ioctl_userptr.size))
+                return -EINVAL;
+
+            if ((ioctl_userptr.addr & (PAGE_SIZE-1)) != 0 ||
+                (ioctl_userptr.flags & ~DOOMDEV2_USERPTR_READONLY) != 0)
+                return -EINVAL;
+
+            if (IS_ERR(buf = alloc_userptr(
+                df->device,
+                ioctl_userptr.addr,
+                ioctl_userptr.size,
+                ioctl_userptr.flags & DOOMDEV2_USERPTR_READONLY
+            )))
+                return PTR_ERR(buf);
 
-    if (IS_ERR(file = anon_inode_getfile("doom_buffer", &buffer_fops, buf, O_RDWR)))
-    {
-        err = PTR_ERR(file);
-        goto err_file;
-    }
-    file->f_mode |= FMODE_LSEEK | FMODE_PREAD | FMODE_PWRITE;
-    buf->file = file;
+            return install_buffer_inode(buf);
+        }
+        case DOOMDEV2_IOCTL_IMPORT_DMABUF:
+        {
+            struct doomdev2_ioctl_import_dmabuf ioctl_import;
+            struct doombuffer* buf;
+            if (copy_from_user(
+                &ioctl_import,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_import_dmabuf)
+            ))
+                return -EFAULT;
 
-    fd_install(fd, file);
+            width = ioctl_import.width;
+            height = ioctl_import.height;
 
-    return fd;
+            if (width == 0 ? height != 0 : (
+                OOBOUNDS(1, 2048, width) ||
+                OOBOUNDS(1, 2048, height) ||
+                ((width&63) != 0)
+            ))
+                return -EINVAL;
 
-err_file:
+            if (IS_ERR(buf = import_dmabuf(df->device, ioctl_import.dmabuf_fd, width, height)))
+                return PTR_ERR(buf);
 
-    put_unused_fd(fd);
-err_get_fd:
+            return install_buffer_inode(buf);
+        }
+        case DOOMDEV2_IOCTL_ATTACH_BUFFER:
+        {
+            int32_t fd;
+            if (copy_from_user(
+                &fd,
+                (const void __user *)arg,
+                sizeof(int32_t)
+            ))
+                return -EFAULT;
 
-    free_pagetable(buf);
-err_alloc_pagetable:
+            return attach_buffer_inode(df, fd);
+        }
+        case DOOMDEV2_IOCTL_LOAD:
+        {
+            struct doomdev2_ioctl_load ioctl_load;
+            if (copy_from_user(
+                &ioctl_load,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_load)
+            ))
+                return -EFAULT;
 
-    return -err;
-}
+            return -load_buffers(df, &ioctl_load);
+        }
+        case DOOMDEV2_IOCTL_READ_RECTS:
+        {
+            struct doomdev2_ioctl_read_rects ioctl_read;
+            if (copy_from_user(
+                &ioctl_read,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_read_rects)
+            ))
+                return -EFAULT;
 
+            return -read_rects(df, &ioctl_read);
+        }
+        case DOOMDEV2_IOCTL_SNAPSHOT:
+        {
+            struct doomdev2_ioctl_snapshot ioctl_snapshot;
+            int fd;
+            if (copy_from_user(
+                &ioctl_snapshot,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_snapshot)
+            ))
+                return -EFAULT;
 
-static long doom_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{
-    int err;
-    struct doomfile* df;
-    uint32_t size, width, height;
+            if ((err = snapshot_buffers(df, &ioctl_snapshot, &fd)))
+                return -err;
 
-    df = file->private_data;
+            return fd;
+        }
+        case DOOMDEV2_IOCTL_RESTORE:
+        {
+            struct doomdev2_ioctl_restore ioctl_restore;
+            if (copy_from_user(
+                &ioctl_restore,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_restore)
+            ))
+                return -EFAULT;
 
-    switch(cmd)
-    {
-        case DOOMDEV2_IOCTL_CREATE_SURFACE:
+            return -restore_buffers(df, &ioctl_restore);
+        }
+        case DOOMDEV2_IOCTL_CREATE_VIEW:
         {
-            struct doomdev2_ioctl_create_surface ioctl_surf;
+            struct doomdev2_ioctl_create_view ioctl_view;
             if (copy_from_user(
-                &ioctl_surf,
+                &ioctl_view,
                 (const void __user *)arg,
-                sizeof(struct doomdev2_ioctl_create_surface)
+                sizeof(struct doomdev2_ioctl_create_view)
             ))
                 return -EFAULT;
-            size = ioctl_surf.width*ioctl_surf.height;
-            width = ioctl_surf.width;
-            height = ioctl_surf.height;
 
-            if (size > 2048*2048)
-                return -EOVERFLOW;
+            return alloc_view_inode(df, ioctl_view.buffer_fd, ioctl_view.offset, ioctl_view.size);
+        }
+        case DOOMDEV2_IOCTL_CREATE_BATCH:
+        {
+            struct doomdev2_ioctl_create_batch ioctl_batch;
+            if (copy_from_user(
+                &ioctl_batch,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_create_batch)
+            ))
+                return -EFAULT;
 
-            if (
-                OOBOUNDS(1, 2048, width) ||
-                OOBOUNDS(1, 2048, height) ||
-                ((width&63) != 0)
-            )
-                return -EINVAL;
-            return alloc_buffer_inode(df, size, width, height);
+            return -create_buffers(df, &ioctl_batch);
         }
-        case DOOMDEV2_IOCTL_CREATE_BUFFER:
+        case DOOMDEV2_IOCTL_CREATE_SHARED:
         {
-            struct doomdev2_ioctl_create_buffer ioctl_buffer;
+            struct doomdev2_ioctl_create_shared ioctl_shared;
             if (copy_from_user(
-                &ioctl_buffer,
+                &ioctl_shared,
                 (const void __user *)arg,
-                sizeof(struct doomdev2_ioctl_create_buffer)
+                sizeof(struct doomdev2_ioctl_create_shared)
             ))
                 return -EFAULT;
 
-            size = ioctl_buffer.size;
-            width = 0;
-            height = 0;
+            return create_shared_inode(df, &ioctl_shared);
+        }
+        case DOOMDEV2_IOCTL_COPY_BUFFER:
+        {
+            struct doomdev2_ioctl_copy_buffer ioctl_copy;
+            if (copy_from_user(
+                &ioctl_copy,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_copy_buffer)
+            ))
+                return -EFAULT;
 
-            if (size > 2048*2048)
-                return -EOVERFLOW;
+            if (ioctl_copy.src_fd < 0)
+                return -EBADF;
 
-            if (OOBOUNDS(1, 2048*2048, size))
-                return -EINVAL;
+            return blit_buffers(df, ioctl_copy.src_fd, ioctl_copy.src_offset,
+                ioctl_copy.dst_fd, ioctl_copy.dst_offset, ioctl_copy.size, 0);
+        }
+        case DOOMDEV2_IOCTL_FILL_BUFFER:
+        {
+            struct doomdev2_ioctl_fill_buffer ioctl_fill;
+            if (copy_from_user(
+                &ioctl_fill,
+                (const void __user *)arg,
+                sizeof(struct doomdev2_ioctl_fill_buffer)
+            ))
+                return -EFAULT;
 
-            return alloc_buffer_inode(df, size, width, height);
+            return blit_buffers(df, -1, 0,
+                ioctl_fill.buffer_fd, ioctl_fill.offset, ioctl_fill.size, ioctl_fill.value);
         }
         case DOOMDEV2_IOCTL_SETUP:
         {
@@ -227,16 +1183,27 @@ static long doom_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
                         goto ioctl_fail;
                     }
 
-                    if (df->buffers.array[i] != 0)
-                        fput(df->buffers.array[i]->file);
-
-                    df->buffers.array[i] = cur_file->private_data;
+                    if (!buffer_device_usable(buf))
+                    {
+                        fput(cur_file);
+                        err = EBUSY;
+                        goto ioctl_fail;
+                    }
 
-                    if (i<2 && df->buffers.array[i]->size == 0)
+                    // a rejected buffer must not stay bound; the device
+                    // would fault on the first write to a read-only one
+                    if ((i<2 && buf->size == 0) ||
+                        (i == 0 && (buffer_root(buf)->flags & DOOMBUFFER_READONLY)))
                     {
+                        fput(cur_file);
                         err = EINVAL;
                         goto ioctl_fail;
                     }
+
+                    if (df->buffers.array[i] != 0)
+                        fput(df->buffers.array[i]->file);
+
+                    df->buffers.array[i] = buf;
                 }
 
 
@@ -252,18 +1219,307 @@ static long doom_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 static void write_cmd(struct doombuffer* cmdbuf, cmd_t *command, size_t pos)
 {
-    cmd_t* page;
+    BUG_ON(pos*sizeof(cmd_t) >= cmdbuf->size);
+
+    ((cmd_t*)cmdbuf->vaddr)[pos] = *command;
+    sync_buffer_for_device(cmdbuf, pos*sizeof(cmd_t), sizeof(cmd_t));
+}
+
+
+// the ring is only ever fed with the device lock held
+
+uint32_t ring_begin(struct doomdevice* device)
+{
+    return doom_ioread(device, HARDDOOM2_CMD_WRITE_IDX);
+}
+
+
+void ring_push(struct doomdevice* device, uint32_t* pos, cmd_t* command)
+{
+    write_cmd(device->cmd, command, *pos);
+    *pos = (*pos+1)&(DOOMDEV_MAX_CMD_COUNT-1);
+}
+
+
+// buffers are in the doomfile order: surf_dst, surf_src, texture, flat, colormap, translation, tranmap
+static void push_setup(struct doomdevice* device, uint32_t* pos, struct doombuffer** buffers)
+{
+    cmd_t setup = {0};
+
+    setup.w[0] = HARDDOOM2_CMD_W0_SETUP(
+        HARDDOOM2_CMD_TYPE_SETUP, //type
+
+        //flags
+        (buffers[0] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_SURF_DST : 0) |
+        (buffers[1] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_SURF_SRC : 0) |
+        (buffers[2] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TEXTURE : 0) |
+        (buffers[3] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_FLAT : 0) |
+        (buffers[5] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TRANSLATION : 0) |
+        (buffers[4] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_COLORMAP : 0) |
+        (buffers[6] != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TRANMAP : 0) ,
+
+        buffers[0] != 0 ? buffers[0]->width : 0, //sdwidth
+        buffers[1] != 0 ? buffers[1]->width : 0 //sswidth
+    );
+
+    if (buffers[0] != 0)
+        setup.w[1] = buffers[0]->dev_pagetable_handle;
+    if (buffers[1] != 0)
+        setup.w[2] = buffers[1]->dev_pagetable_handle;
+    if (buffers[2] != 0)
+        setup.w[3] = buffers[2]->dev_pagetable_handle;
+    if (buffers[3] != 0)
+        setup.w[4] = buffers[3]->dev_pagetable_handle;
+    if (buffers[5] != 0)
+        setup.w[5] = buffers[5]->dev_pagetable_handle;
+    if (buffers[4] != 0)
+        setup.w[6] = buffers[4]->dev_pagetable_handle;
+    if (buffers[6] != 0)
+        setup.w[7] = buffers[6]->dev_pagetable_handle;
+
+    ring_push(device, pos, &setup);
+}
+
+
+// for buffers whose generations are not tracked, like the windows of blit.c
+void ring_setup(struct doomdevice* device, uint32_t* pos, struct doombuffer** buffers)
+{
+    device->setup_valid = 0;
+    push_setup(device, pos, buffers);
+}
+
+
+// whether the buffer may have been written since the device last saw it;
+// nothing tells us when user memory and dma-bufs are written
+static int bind_stale(struct doomdevice* device, struct doombuffer* buf, int slot)
+{
+    struct doombuffer* root = buffer_root(buf);
+
+    return READ_ONCE(root->gen) != device->setup_gen[slot] ||
+        (root->flags & (DOOMBUFFER_USERPTR|DOOMBUFFER_DMABUF|DOOMBUFFER_EXPORTED));
+}
+
+
+// SETUP drops every cache and TLB entry of the device, so it is only sent
+// when the device points at other buffers than it did the last time, or
+// when a buffer it holds on to was written since. The texture and tranmap
+// caches can be reset on their own instead. The batch has to be kicked,
+// or setup_valid cleared.
+void ring_bind(struct doomdevice* device, uint32_t* pos, struct doombuffer** buffers)
+{
+    // the FE keeps the current flat, colormap and translation, and loads
+    // them again only for another index or after SETUP; the surfaces are
+    // only accessed through the TLB
+    static const uint32_t cache_reset[7] = {
+        0, 0, HARDDOOM2_RESET_TEX_CACHE, 0, 0, 0, HARDDOOM2_RESET_SW_CACHE
+    };
+    static const int fe_held[7] = {0, 0, 0, 1, 1, 1, 0};
+    uint32_t reset = 0;
+    int same = device->setup_valid;
+    int i;
+
+    for (i = 0; i < 7 && same; i++)
+        same = device->setup_pt_gen[i] == (buffers[i] != NULL ? buffers[i]->pt_gen : 0);
+
+    for (i = 0; i < 7 && same; i++)
+        if (fe_held[i] && buffers[i] != NULL && bind_stale(device, buffers[i], i))
+            same = 0;
+
+    if (!same)
+        push_setup(device, pos, buffers);
+
+    for (i = 0; i < 7; i++)
+    {
+        if (buffers[i] == NULL)
+        {
+            device->setup_pt_gen[i] = 0;
+            continue;
+        }
+
+        if (same && bind_stale(device, buffers[i], i))
+            reset |= cache_reset[i];
+
+        device->setup_pt_gen[i] = buffers[i]->pt_gen;
+        device->setup_gen[i] = READ_ONCE(buffer_root(buffers[i])->gen);
+    }
+    device->setup_valid = 1;
+
+    // the previous batch has finished, the device is idle
+    if (reset != 0)
+        doom_iowrite(device, reset, HARDDOOM2_RESET);
+
+    // the batch draws into it, later readers must not see cached contents
+    if (buffers[0] != NULL)
+        buffer_touch(buffers[0]);
+}
+
+
+// the last pushed command has to carry PING_SYNC
+void ring_kick(struct doomdevice* device, uint32_t pos)
+{
+    device->kick_ns = ktime_get_ns();
+    doom_iowrite(device, pos, HARDDOOM2_CMD_WRITE_IDX);
+}
+
+
+// whenever the watchdog fires, a batch is only slow while its commands are
+// still being fetched, or while the units are busy with it: the FE fetches
+// a batch long before it is drawn. It is taken for a hang once the device
+// is idle without having finished it, or the units stay stuck in the same
+// state with commands still waiting to be fetched
+static int ring_watchdog(struct doomdevice* device, uint32_t* read_idx, uint32_t* status)
+{
+    uint32_t now = doom_ioread(device, HARDDOOM2_CMD_READ_IDX);
+    uint32_t busy = doom_ioread(device, HARDDOOM2_STATUS);
+    uint32_t last = *status;
+
+    *status = busy;
+
+    if (now != *read_idx)
+    {
+        *read_idx = now;
+        return 0;
+    }
+
+    // everything is fetched, the units are still drawing it
+    if (busy != 0 && now == doom_ioread(device, HARDDOOM2_CMD_WRITE_IDX))
+        return 0;
+
+    // the rest waits for the units, which are still moving
+    if (busy != 0 && busy != last)
+        return 0;
+
+    // an idle device may just have finished, with the IRQ thread yet to
+    // complete pong
+    if (completion_done(&device->pong)
+        || (atomic_read(&device->intr_pending) & HARDDOOM2_INTR_PONG_SYNC)
+        || (doom_ioread(device, HARDDOOM2_INTR) & HARDDOOM2_INTR_PONG_SYNC))
+        return 0;
+
+    printk(KERN_ERR DOOMHDR "Device %d: batch hung at READ_IDX %x, STATUS %x\n",
+        device->id, now, busy);
+    WRITE_ONCE(device->hang_c, device->hang_c + 1);
+
+    return 1;
+}
+
+
+// a frame grab is drained by whoever comes next, so neither a signal to
+// that task nor the time it waited says anything about the grab, whose
+// files are held in device->grab anyway
+static int ring_wait_batch(struct doomdevice* device, int grab)
+{
+    uint32_t read_idx = doom_ioread(device, HARDDOOM2_CMD_READ_IDX);
+    uint32_t status = doom_ioread(device, HARDDOOM2_STATUS);
+    uint64_t took;
+    long ret;
+
+    for (;;)
+    {
+        if (grab)
+            ret = wait_for_completion_timeout(&device->pong,
+                msecs_to_jiffies(READ_ONCE(device->watchdog_ms)));
+        else
+            ret = wait_for_completion_killable_timeout(&device->pong,
+                msecs_to_jiffies(READ_ONCE(device->watchdog_ms)));
+
+        if (ret > 0)
+            break;
+
+        // the batch cannot be left running, its buffers may go away with
+        // the dying submitter
+        if (ret < 0)
+        {
+            doomdev_recover(device);
+            return EINTR;
+        }
+
+        if (ring_watchdog(device, &read_idx, &status))
+        {
+            doomdev_recover(device);
+            return EIO;
+        }
+    }
+
+    // a grab is drained long after it finished, the wait says nothing
+    // about how long it ran
+    took = ktime_get_ns() - device->kick_ns;
+    if (!grab && took > device->batch_max_ns)
+        WRITE_ONCE(device->batch_max_ns, took);
+
+    if (device->enabled)
+        return 0;
+
+    // the batch that just ran caused the fault, only its submitter fails
+    doomdev_recover(device);
+    return EIO;
+}
+
+
+int ring_wait(struct doomdevice* device)
+{
+    return ring_wait_batch(device, 0);
+}
+
+
+int ring_kick_wait(struct doomdevice* device, uint32_t pos)
+{
+    ring_kick(device, pos);
+    return ring_wait(device);
+}
+
+
+// waits for the work submitted before the call; submitters keep the lock
+// until their batch is done, save for a frame grab, which is drained here
+void ring_quiesce(struct doomdevice* device)
+{
+    mutex_lock(&device->lock);
+    ring_drain(device);
+    mutex_unlock(&device->lock);
+}
+
+
+// a frame grab is kicked without waiting; whoever takes the device lock
+// next waits for it before looking at the device. A failed grab leaves the
+// shadow with whatever the device got to draw, so the CPU gets EIO from it
+// until it is grabbed into again
+void ring_drain(struct doomdevice* device)
+{
+    int i;
+
+    if (device->grab[0] == NULL)
+        return;
+
+    if (ring_wait_batch(device, 1))
+    {
+        printk(KERN_INFO DOOMHDR "Device %d: frame grab failed\n", device->id);
+        WRITE_ONCE(((struct doombuffer*)device->grab[1]->private_data)->grab_failed, 1);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        WRITE_ONCE(buffer_root(device->grab[i]->private_data)->grabbed_by, NULL);
+        fput(device->grab[i]);
+        device->grab[i] = NULL;
+    }
+}
+
+
+// readies the device for a batch; caller holds the device lock. A fault
+// that came in while the device was idle has no waiter to reset it, so
+// the next submitter does
+int ring_ready(struct doomdevice* device)
+{
+    ring_drain(device);
 
-    pos = pos*sizeof(cmd_t);
-    BUG_ON(pos>>12 >= cmdbuf->page_c);
-    BUG_ON((pos & (PAGE_SIZE-1)) + sizeof(cmd_t) > PAGE_SIZE);
+    if (!device->enabled)
+        doomdev_recover(device);
 
-    page = (cmd_t*)(cmdbuf->usr_pagetable[pos >> 12]);
-    page[(pos&(PAGE_SIZE-1))/sizeof(cmd_t)] = *command;
+    return device->enabled ? 0 : EIO;
 }
 
 
-static int decode_cmd(struct doomfile* df, cmd_t* decoded_cmd, struct doomdev2_cmd* raw_cmd)
+int decode_cmd(struct doomfile* df, cmd_t* decoded_cmd, struct doomdev2_cmd* raw_cmd)
 {
     int i;
 
@@ -621,8 +1877,8 @@ static int decode_cmd(struct doomfile* df, cmd_t* decoded_cmd, struct doomdev2_c
 static ssize_t doom_write(struct file *file, const char __user *user_data, size_t count, loff_t *off)
 {
     int err;
-    uint32_t cmd_c = 0;
-    uint32_t start;
+    uint32_t cmd_c;
+    uint32_t pos;
     struct doomfile* df;
     cmd_t cur_cmd = {0};
 
@@ -636,15 +1892,12 @@ static ssize_t doom_write(struct file *file, const char __user *user_data, size_
 
     count /= sizeof(struct doomdev2_cmd);
 
-    mutex_lock(&df->lock);
-    mutex_lock(&df->device->lock);
+    // nothing would carry the PING_SYNC
+    if (count == 0)
+        return 0;
 
-    // that means that the device has crashed and does not accept commands
-    if (!df->device->enabled)
-    {
-        err = -EIO;
-        goto err_end_lock;
-    }
+    mutex_lock(&df->lock);
+    df->placed = 1;
 
     // space for setup and one free space for the cyclic buffer indices
     if (count >= DOOMDEV_MAX_CMD_COUNT-1)
@@ -657,80 +1910,58 @@ static ssize_t doom_write(struct file *file, const char __user *user_data, size_
     ))
     {
         err = -EFAULT;
-        goto err_end_lock;
+        goto err_end_df_lock;
     }
 
-    // decode setup
-    cur_cmd.w[0] = HARDDOOM2_CMD_W0_SETUP(
-        HARDDOOM2_CMD_TYPE_SETUP, //type
-
-        //flags
-        (df->buffers.name.surf_dst != 0 ? HARDDOOM2_CMD_FLAG_SETUP_SURF_DST : 0) |
-        (df->buffers.name.surf_src != 0 ? HARDDOOM2_CMD_FLAG_SETUP_SURF_SRC : 0) |
-        (df->buffers.name.texture != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TEXTURE : 0) |
-        (df->buffers.name.flat != 0 ? HARDDOOM2_CMD_FLAG_SETUP_FLAT : 0) |
-        (df->buffers.name.translation != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TRANSLATION : 0) |
-        (df->buffers.name.colormap != 0 ? HARDDOOM2_CMD_FLAG_SETUP_COLORMAP : 0) |
-        (df->buffers.name.tranmap != 0 ? HARDDOOM2_CMD_FLAG_SETUP_TRANMAP : 0) ,
-
-        df->buffers.name.surf_dst != 0 ? df->buffers.name.surf_dst->width : 0, //sdwidth
-        df->buffers.name.surf_src != 0 ? df->buffers.name.surf_src->width : 0 //sswidth
-    );
+    if (df->split_c != 0)
+    {
+        if ((err = -split_write(df, count)))
+            goto err_end_df_lock;
 
-    if (df->buffers.name.surf_dst != 0)
-        cur_cmd.w[1] = df->buffers.name.surf_dst->dev_pagetable_handle;
-    if (df->buffers.name.surf_src != 0)
-        cur_cmd.w[2] = df->buffers.name.surf_src->dev_pagetable_handle;
-    if (df->buffers.name.texture != 0)
-        cur_cmd.w[3] = df->buffers.name.texture->dev_pagetable_handle;
-    if (df->buffers.name.flat != 0)
-        cur_cmd.w[4] = df->buffers.name.flat->dev_pagetable_handle;
-    if (df->buffers.name.translation != 0)
-        cur_cmd.w[5] = df->buffers.name.translation->dev_pagetable_handle;
-    if (df->buffers.name.colormap != 0)
-        cur_cmd.w[6] = df->buffers.name.colormap->dev_pagetable_handle;
-    if (df->buffers.name.tranmap != 0)
-        cur_cmd.w[7] = df->buffers.name.tranmap->dev_pagetable_handle;
+        mutex_unlock(&df->lock);
+        return count*sizeof(struct doomdev2_cmd);
+    }
 
+    atomic_inc(&df->device->queued);
+    mutex_lock(&df->device->lock);
 
-    start = ioread32(df->device->registers+HARDDOOM2_CMD_WRITE_IDX);
+    if ((err = -ring_ready(df->device)))
+        goto err_end_lock;
 
-    write_cmd(df->device->cmd, &cur_cmd, start);
-    start = (start+1)&(DOOMDEV_MAX_CMD_COUNT-1);
-    cmd_c++;
+    pos = ring_begin(df->device);
+    ring_bind(df->device, &pos, df->buffers.array);
 
     // decode rest of the commands
-    while (cmd_c <= count)
+    for (cmd_c = 0; cmd_c < count; cmd_c++)
     {
-        if ((err = -decode_cmd(df, &cur_cmd, &df->raw_cmds[cmd_c-1])))
+        if ((err = -decode_cmd(df, &cur_cmd, &df->raw_cmds[cmd_c])))
+        {
+            // the SETUP never reaches the device
+            df->device->setup_valid = 0;
             goto err_end_lock;
+        }
 
          // last command
-        if (cmd_c == count)
+        if (cmd_c == count-1)
             cur_cmd.w[0] |= HARDDOOM2_CMD_FLAG_PING_SYNC;
 
-        write_cmd(df->device->cmd, &cur_cmd, start);
-        start = (start+1)&(DOOMDEV_MAX_CMD_COUNT-1);
-        cmd_c++;
+        ring_push(df->device, &pos, &cur_cmd);
     }
 
-    iowrite32(start, df->device->registers+HARDDOOM2_CMD_WRITE_IDX);
-    down(&df->device->wait_pong);
-
     // that means that the device has crashed and does not accept commands, the operation has failed
-    if (!df->device->enabled)
-    {
-        err = -EIO;
+    if ((err = -ring_kick_wait(df->device, pos)))
         goto err_end_lock;
-    }
 
     mutex_unlock(&df->device->lock);
+    atomic_dec(&df->device->queued);
     mutex_unlock(&df->lock);
 
-    return (cmd_c-1)*sizeof(struct doomdev2_cmd);
+    return cmd_c*sizeof(struct doomdev2_cmd);
 
 err_end_lock:
     mutex_unlock(&df->device->lock);
+    atomic_dec(&df->device->queued);
+err_end_df_lock:
     mutex_unlock(&df->lock);
 
 err_end:
@@ -741,15 +1972,16 @@ err_end:
 int chardev_create(struct doomdevice* doomdev)
 {
     // create device instance (the file will get created in /dev)
-    doomdev->chr_device = device_create(
+    doomdev->chr_device = device_create_with_groups(
         &doom_class,
-        &(doomdev->pci_device->dev),
+        doomdev->dev,
         doom_major+doomdev->id,
-        0,
+        doomdev,
+        doom_groups,
         "doom%d",
         doomdev->id
     );
-    if (0 == (doomdev->chr_device))
+    if (IS_ERR(doomdev->chr_device))
         return ENOMEM;
     return 0;
 }
@@ -781,28 +2013,38 @@ int chardev_init(void)
         goto err_cache_init2;
     }
 
-    // region
-    if ((err = alloc_chrdev_region(&doom_major, 0, MAX_DEVICE_COUNT, "doomdev")))
+    // region, one minor per device and /dev/doom-any
+    if ((err = alloc_chrdev_region(&doom_major, 0, MAX_DEVICE_COUNT+1, "doomdev")))
         goto err_alloc;
 
     // init and add the device
     cdev_init(&doom_cdev, &doom_fops);
-    if ((err = cdev_add(&doom_cdev, doom_major, MAX_DEVICE_COUNT)))
+    if ((err = cdev_add(&doom_cdev, doom_major, MAX_DEVICE_COUNT+1)))
         goto err_cdev;
 
     // register the class
     if ((err = class_register(&doom_class)))
         goto err_class;
 
+    // contexts opened here go to the least loaded device
+    if (IS_ERR(doom_any = device_create(&doom_class, NULL, doom_major+DOOM_ANY_MINOR, NULL, "doom-any")))
+    {
+        err = PTR_ERR(doom_any);
+        goto err_doom_any;
+    }
+
     return 0;
 
+    device_destroy(&doom_class, doom_major+DOOM_ANY_MINOR);
+err_doom_any:
+
     class_unregister(&doom_class);
 err_class:
 
     cdev_del(&doom_cdev);
 err_cdev:
 
-    unregister_chrdev_region(doom_major, MAX_DEVICE_COUNT);
+    unregister_chrdev_region(doom_major, MAX_DEVICE_COUNT+1);
 err_alloc:
 
     kmem_cache_destroy(doombuffer_cache);
@@ -816,9 +2058,10 @@ err_cache_init:
 
 void chardev_exit(void)
 {
+    device_destroy(&doom_class, doom_major+DOOM_ANY_MINOR);
     class_unregister(&doom_class);
     cdev_del(&doom_cdev);
-    unregister_chrdev_region(doom_major, MAX_DEVICE_COUNT);
+    unregister_chrdev_region(doom_major, MAX_DEVICE_COUNT+1);
     kmem_cache_destroy(doombuffer_cache);
     kmem_cache_destroy(doomfile_cache);
 }
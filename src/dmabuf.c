@@ -0,0 +1,289 @@
+#include "doomdriver.h"
+#include "doomdev2.h"
+
+#include <linux/err.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#include <linux/iosys-map.h>
+
+
+static struct sg_table* doom_dmabuf_map(struct dma_buf_attachment* attach, enum dma_data_direction dir);
+static void doom_dmabuf_unmap(struct dma_buf_attachment* attach, struct sg_table* sgt, enum dma_data_direction dir);
+static void doom_dmabuf_release(struct dma_buf* dmabuf);
+static int doom_dmabuf_mmap(struct dma_buf* dmabuf, struct vm_area_struct* vma);
+static int doom_dmabuf_begin_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir);
+static int doom_dmabuf_end_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir);
+
+static const struct dma_buf_ops doom_dmabuf_ops = {
+    .map_dma_buf = doom_dmabuf_map,
+    .unmap_dma_buf = doom_dmabuf_unmap,
+    .release = doom_dmabuf_release,
+    .mmap = doom_dmabuf_mmap,
+    .begin_cpu_access = doom_dmabuf_begin_cpu_access,
+    .end_cpu_access = doom_dmabuf_end_cpu_access,
+};
+
+
+static struct sg_table* doom_dmabuf_map(struct dma_buf_attachment* attach, enum dma_data_direction dir)
+{
+    int err;
+    struct doombuffer* buf;
+    struct sg_table* sgt;
+
+    buf = attach->dmabuf->priv;
+
+    if (0 == (sgt = kmalloc(sizeof(struct sg_table), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc;
+    }
+
+    if ((err = -sg_alloc_table_from_pages(sgt, buf->pages, buf->page_c, 0, buf->size, GFP_KERNEL)))
+        goto err_sg_alloc;
+
+    // mapped for the importing device, ours keeps its own mapping
+    if ((err = -dma_map_sgtable(attach->dev, sgt, dir, 0)))
+        goto err_map;
+
+    return sgt;
+
+err_map:
+    sg_free_table(sgt);
+err_sg_alloc:
+
+    kfree(sgt);
+err_alloc:
+
+    return ERR_PTR(-err);
+}
+
+
+static void doom_dmabuf_unmap(struct dma_buf_attachment* attach, struct sg_table* sgt, enum dma_data_direction dir)
+{
+    dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+    sg_free_table(sgt);
+    kfree(sgt);
+}
+
+
+static void doom_dmabuf_release(struct dma_buf* dmabuf)
+{
+    struct doombuffer* buf;
+
+    buf = dmabuf->priv;
+    fput(buf->file);
+}
+
+
+static int doom_dmabuf_mmap(struct dma_buf* dmabuf, struct vm_area_struct* vma)
+{
+    struct doombuffer* buf;
+
+    buf = dmabuf->priv;
+
+    if ((buffer_root(buf)->flags & DOOMBUFFER_READONLY) && (vma->vm_flags & VM_WRITE))
+        return -EPERM;
+
+    return vm_map_pages(vma, buf->pages, buf->page_c);
+}
+
+
+static int doom_dmabuf_begin_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir)
+{
+    struct doombuffer* buf;
+
+    buf = dmabuf->priv;
+    return -sync_buffer_for_cpu(buf, 0, buf->size);
+}
+
+
+static int doom_dmabuf_end_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir)
+{
+    int err;
+    struct doombuffer* buf;
+
+    buf = dmabuf->priv;
+    err = sync_buffer_cpu_done(buf, 0, buf->size, 1);
+    buffer_touch(buf);
+    return -err;
+}
+
+
+int export_buffer_dmabuf(struct doombuffer* buf, uint32_t flags)
+{
+    int err;
+    int fd;
+    struct dma_buf* dmabuf;
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+    // imported buffers have no pages of their own to hand out
+    if (buffer_root(buf)->flags & DOOMBUFFER_DMABUF)
+        return -EINVAL;
+
+    exp_info.ops = &doom_dmabuf_ops;
+    exp_info.size = PAGE_ALIGN(buf->size);
+    exp_info.flags = (buffer_root(buf)->flags & DOOMBUFFER_READONLY) ? O_RDONLY : O_RDWR;
+    exp_info.priv = buf;
+
+    // mappings of the dma-buf write the pages without telling us
+    mutex_lock(&buffer_root(buf)->lock);
+    buffer_root(buf)->flags |= DOOMBUFFER_EXPORTED;
+    mutex_unlock(&buffer_root(buf)->lock);
+
+    // the dma-buf keeps the buffer alive
+    get_file(buf->file);
+
+    if (IS_ERR(dmabuf = dma_buf_export(&exp_info)))
+    {
+        err = -PTR_ERR(dmabuf);
+        goto err_export;
+    }
+
+    if ((fd = dma_buf_fd(dmabuf, (flags & DOOMDEV2_DMABUF_CLOEXEC) ? O_CLOEXEC : 0)) < 0)
+    {
+        // drops the buffer reference through release
+        dma_buf_put(dmabuf);
+        return fd;
+    }
+
+    return fd;
+
+err_export:
+    fput(buf->file);
+
+    return -err;
+}
+
+
+struct doombuffer* import_dmabuf(struct doomdevice* device, int fd, uint32_t width, uint32_t height)
+{
+    int err;
+    struct doombuffer* buf;
+    struct dma_buf* dmabuf;
+    struct scatterlist* sg;
+    struct iosys_map map;
+    int n_pages;
+    int i;
+
+    if (IS_ERR(dmabuf = dma_buf_get(fd)))
+        return ERR_CAST(dmabuf);
+
+    n_pages = dmabuf->size / PAGE_SIZE;
+
+    if ((dmabuf->size & (PAGE_SIZE-1)) != 0 || OOBOUNDS(1, DOOMBUFFER_MAX_PAGES, n_pages))
+    {
+        err = EINVAL;
+        goto err_size;
+    }
+
+    if (width != 0 && (size_t)width*height > dmabuf->size)
+    {
+        err = EINVAL;
+        goto err_size;
+    }
+
+    if (0 == (buf = kmem_cache_alloc(doombuffer_cache, GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_cache_alloc;
+    }
+
+    buf->size = width != 0 ? width*height : dmabuf->size;
+    buf->width = width;
+    buf->height = height;
+    buf->parent = NULL;
+    buf->flags = DOOMBUFFER_DMABUF;
+    buf->mm = NULL;
+    buf->pages = NULL;
+    buf->shared = NULL;
+    INIT_LIST_HEAD(&buf->purge_node);
+    mutex_init(&buf->lock);
+    buf->device = device;
+    buf->pt_gen = buf->gen = next_gen(buf->device);
+    buf->grabbed_by = NULL;
+    buf->grab_failed = 0;
+
+    if ((err = alloc_dev_pagetable(buf, n_pages)))
+        goto err_alloc_dev_pagetable;
+
+    if (IS_ERR(buf->attach = dma_buf_attach(dmabuf, device->dev)))
+    {
+        err = -PTR_ERR(buf->attach);
+        goto err_attach;
+    }
+
+    if (IS_ERR(buf->sgt = dma_buf_map_attachment_unlocked(buf->attach, DMA_BIDIRECTIONAL)))
+    {
+        err = -PTR_ERR(buf->sgt);
+        goto err_map_attachment;
+    }
+
+    // split the segments into device pages
+    buf->page_c = 0;
+    for_each_sgtable_dma_sg(buf->sgt, sg, i)
+    {
+        dma_addr_t addr = sg_dma_address(sg);
+        dma_addr_t end = addr + sg_dma_len(sg);
+
+        if ((addr & (PAGE_SIZE-1)) != 0 || (end & (PAGE_SIZE-1)) != 0)
+        {
+            err = EINVAL;
+            goto err_pagetable;
+        }
+
+        for (; addr != end && buf->page_c < n_pages; addr += PAGE_SIZE)
+            buf->dev_pagetable[buf->page_c++] = HARDDOOM2_PTE_VALID|HARDDOOM2_PTE_WRITABLE | (addr >> 8);
+    }
+
+    if (buf->page_c != n_pages)
+    {
+        err = EINVAL;
+        goto err_pagetable;
+    }
+
+    // read() and write() still go through a kernel mapping
+    if ((err = -dma_buf_vmap_unlocked(dmabuf, &map)))
+        goto err_pagetable;
+
+    if (map.is_iomem)
+    {
+        dma_buf_vunmap_unlocked(dmabuf, &map);
+        err = EINVAL;
+        goto err_pagetable;
+    }
+    buf->vaddr = map.vaddr;
+
+    return buf;
+
+err_pagetable:
+    dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt, DMA_BIDIRECTIONAL);
+err_map_attachment:
+
+    dma_buf_detach(dmabuf, buf->attach);
+err_attach:
+
+    free_dev_pagetable(buf, n_pages);
+err_alloc_dev_pagetable:
+
+    kmem_cache_free(doombuffer_cache, buf);
+err_cache_alloc:
+err_size:
+
+    dma_buf_put(dmabuf);
+
+    return ERR_PTR(-err);
+}
+
+
+void release_imported_dmabuf(struct doombuffer* buf)
+{
+    struct dma_buf* dmabuf;
+    struct iosys_map map = IOSYS_MAP_INIT_VADDR(buf->vaddr);
+
+    dmabuf = buf->attach->dmabuf;
+
+    dma_buf_vunmap_unlocked(dmabuf, &map);
+    dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt, DMA_BIDIRECTIONAL);
+    dma_buf_detach(dmabuf, buf->attach);
+    dma_buf_put(dmabuf);
+}
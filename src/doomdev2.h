@@ -20,6 +20,55 @@ struct doomdev2_ioctl_create_buffer {
 	uint32_t size;
 };
 
+/* Width 0 creates a plain buffer of the given size, otherwise a surface.
+ * Node -1 places the pages on the device's NUMA node.  */
+struct doomdev2_ioctl_create_on_node {
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	int32_t node;
+};
+
+#define DOOMDEV2_USERPTR_READONLY	0x01
+
+struct doomdev2_ioctl_create_userptr {
+	/* Must be aligned to the page size (0x1000).  */
+	uint64_t addr;
+	uint32_t size;
+	uint32_t flags;
+};
+
+/* Width 0 imports a plain buffer, otherwise a surface.  */
+struct doomdev2_ioctl_import_dmabuf {
+	int32_t dmabuf_fd;
+	uint16_t width;
+	uint16_t height;
+};
+
+struct doomdev2_ioctl_create_view {
+	int32_t buffer_fd;
+	/* Must be a multiple of the page size (0x1000).  */
+	uint32_t offset;
+	uint32_t size;
+};
+
+struct doomdev2_load_entry {
+	int32_t file_fd;
+	int32_t buffer_fd;
+	uint64_t file_offset;
+	uint32_t buffer_offset;
+	uint32_t size;
+};
+
+/* Entries are loaded in order, on failure the ones before the failing
+ * entry have been loaded.  file_fd may not be a buffer, use
+ * DOOMDEV2_IOCTL_COPY_BUFFER to copy between buffers.  */
+struct doomdev2_ioctl_load {
+	uint64_t entries;
+	uint32_t count;
+	uint32_t _pad;
+};
+
 struct doomdev2_ioctl_setup {
 	int32_t surf_dst_fd;
 	int32_t surf_src_fd;
@@ -30,9 +79,180 @@ struct doomdev2_ioctl_setup {
 	int32_t tranmap_fd;
 };
 
+/* Width 0 creates a plain buffer of the given size, otherwise a surface
+ * (size is ignored).  Data, if not 0, points to the initial contents of
+ * the whole buffer.  Fd is filled in on return.  */
+struct doomdev2_create_entry {
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	uint64_t data;
+	int32_t fd;
+	uint32_t _pad;
+};
+
+#define DOOMDEV2_CREATE_BATCH_MAX	4096
+
+/* Either all buffers are created, or none is.  */
+struct doomdev2_ioctl_create_batch {
+	uint64_t entries;
+	uint32_t count;
+	uint32_t _pad;
+};
+
+/* Creates a read-only buffer (or surface, if width is not 0) with the
+ * given contents.  If a buffer with identical contents and geometry
+ * already exists on the device, its pages are shared instead.  */
+struct doomdev2_ioctl_create_shared {
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	uint64_t data;
+};
+
+/* Takes an array of count buffer fds, returns a snapshot fd holding a
+ * copy of their current contents.  */
+struct doomdev2_ioctl_snapshot {
+	uint64_t buffer_fds;
+	uint32_t count;
+	uint32_t _pad;
+};
+
+/* Copies a snapshot back, entry i into buffer_fds[i], which must have the
+ * geometry of the snapshotted buffer.  An fd of -1 creates a new buffer
+ * and is replaced by its fd on return.  On failure no new fd is created,
+ * but existing buffers may have been partially restored.  */
+struct doomdev2_ioctl_restore {
+	int32_t snapshot_fd;
+	uint32_t count;
+	uint64_t buffer_fds;
+};
+
+#define DOOMDEV2_SPLIT_MAX 8
+
+/* Splits rendering of this context between its own device and the given
+ * contexts of other devices, each drawing one horizontal band of surf_dst.
+ * Their SETUP must name the same buffers (see ATTACH_BUFFER), and none of
+ * them can be split itself.  A count of 0 turns splitting off.  */
+struct doomdev2_ioctl_set_split {
+	uint64_t context_fds;
+	uint32_t count;
+	uint32_t _pad;
+};
+
+/* Offsets and size are in bytes; both buffers must belong to the device
+ * the ioctl is issued on.  */
+struct doomdev2_ioctl_copy_buffer {
+	int32_t src_fd;
+	int32_t dst_fd;
+	uint32_t src_offset;
+	uint32_t dst_offset;
+	uint32_t size;
+	uint32_t _pad;
+};
+
+struct doomdev2_ioctl_fill_buffer {
+	int32_t buffer_fd;
+	uint32_t offset;
+	uint32_t size;
+	uint8_t value;
+	uint8_t _pad[3];
+};
+
 #define DOOMDEV2_IOCTL_CREATE_SURFACE _IOW('D', 0x00, struct doomdev2_ioctl_create_surface)
 #define DOOMDEV2_IOCTL_CREATE_BUFFER _IOW('D', 0x01, struct doomdev2_ioctl_create_buffer)
 #define DOOMDEV2_IOCTL_SETUP _IOW('D', 0x02, struct doomdev2_ioctl_setup)
+#define DOOMDEV2_IOCTL_CREATE_VIEW _IOW('D', 0x03, struct doomdev2_ioctl_create_view)
+#define DOOMDEV2_IOCTL_CREATE_USERPTR _IOW('D', 0x04, struct doomdev2_ioctl_create_userptr)
+#define DOOMDEV2_IOCTL_IMPORT_DMABUF _IOW('D', 0x05, struct doomdev2_ioctl_import_dmabuf)
+#define DOOMDEV2_IOCTL_LOAD _IOW('D', 0x06, struct doomdev2_ioctl_load)
+#define DOOMDEV2_IOCTL_CREATE_ON_NODE _IOW('D', 0x07, struct doomdev2_ioctl_create_on_node)
+#define DOOMDEV2_IOCTL_COPY_BUFFER _IOW('D', 0x08, struct doomdev2_ioctl_copy_buffer)
+#define DOOMDEV2_IOCTL_FILL_BUFFER _IOW('D', 0x09, struct doomdev2_ioctl_fill_buffer)
+#define DOOMDEV2_IOCTL_CREATE_BATCH _IOW('D', 0x0a, struct doomdev2_ioctl_create_batch)
+#define DOOMDEV2_IOCTL_CREATE_SHARED _IOW('D', 0x0b, struct doomdev2_ioctl_create_shared)
+/* Takes a buffer fd of another device, returns a buffer fd of this device
+ * sharing its pages.  Needs coherent DMA on both devices, EOPNOTSUPP
+ * otherwise.  */
+#define DOOMDEV2_IOCTL_ATTACH_BUFFER _IOW('D', 0x0c, int32_t)
+#define DOOMDEV2_IOCTL_SNAPSHOT _IOW('D', 0x0e, struct doomdev2_ioctl_snapshot)
+#define DOOMDEV2_IOCTL_RESTORE _IOW('D', 0x0f, struct doomdev2_ioctl_restore)
+
+/* The node of the calling CPU.  */
+#define DOOMDEV2_AFFINITY_LOCAL	(-2)
+
+/* Only for contexts of /dev/doom-any, before they do anything else: moves
+ * the context to the least loaded device on the given NUMA node (-1 for
+ * any node, or if the node has no device).  */
+#define DOOMDEV2_IOCTL_SET_AFFINITY _IOW('D', 0x10, int32_t)
+#define DOOMDEV2_IOCTL_SET_SPLIT _IOW('D', 0x11, struct doomdev2_ioctl_set_split)
+
+#define DOOMDEV2_GRAB_SHADOWS	4
+
+/* Queues a copy of the given surface (an fd of this device) into a
+ * read-only shadow surface of the same size, and returns the fd of the
+ * shadow without waiting for the copy; reading or mapping the shadow waits
+ * for it.  Shadows come from a pool of DOOMDEV2_GRAB_SHADOWS per context,
+ * a shadow is reused once its fds and mappings are gone.  */
+#define DOOMDEV2_IOCTL_GRAB_FRAME _IOW('D', 0x12, int32_t)
+
+/* Buffer fds can also be mmapped, save for imported dma-bufs and views
+ * not starting at a page boundary; read-only buffers only for reading.  */
+
+/* Surface fd ioctls.  */
+
+struct doomdev2_ioctl_surface_rect {
+	uint16_t pos_x;
+	uint16_t pos_y;
+	uint16_t width;
+	uint16_t height;
+	/* Distance between rows in user memory, at least width.  */
+	uint32_t stride;
+	uint32_t _pad;
+	uint64_t data;
+};
+
+#define DOOMDEV2_IOCTL_READ_RECT _IOW('D', 0x40, struct doomdev2_ioctl_surface_rect)
+#define DOOMDEV2_IOCTL_WRITE_RECT _IOW('D', 0x41, struct doomdev2_ioctl_surface_rect)
+
+/* /dev/doom* gather readback, built on the rectangle above.  Waits for
+ * rendering submitted before the call, then copies the entries in order;
+ * on failure the ones before the failing entry have been copied.  */
+
+struct doomdev2_read_rect_entry {
+	int32_t surface_fd;
+	uint32_t _pad;
+	struct doomdev2_ioctl_surface_rect rect;
+};
+
+struct doomdev2_ioctl_read_rects {
+	uint64_t entries;
+	uint32_t count;
+	uint32_t _pad;
+};
+
+#define DOOMDEV2_IOCTL_READ_RECTS _IOW('D', 0x0d, struct doomdev2_ioctl_read_rects)
+
+#define DOOMDEV2_DMABUF_CLOEXEC		0x01
+
+/* Takes the flags, returns a dma-buf fd.  */
+#define DOOMDEV2_IOCTL_EXPORT_DMABUF _IOW('D', 0x42, uint32_t)
+
+#define DOOMDEV2_MADV_WILLNEED	0
+#define DOOMDEV2_MADV_DONTNEED	1
+
+/* A DONTNEED buffer may lose its contents under memory pressure, and
+ * cannot be used by the device, viewed or exported until marked
+ * WILLNEED again.  Retained is 0 on return if the contents were lost (they
+ * are zeroed by WILLNEED).  Only plain buffers created on the device
+ * qualify; they are not purged while a view, export or SETUP refers to
+ * them.  */
+struct doomdev2_ioctl_madvise {
+	uint32_t advice;
+	uint32_t retained;
+};
+
+#define DOOMDEV2_IOCTL_MADVISE _IOWR('D', 0x43, struct doomdev2_ioctl_madvise)
 
 enum doomdev2_cmd_type {
 	DOOMDEV2_CMD_TYPE_COPY_RECT = 0,
@@ -2,16 +2,21 @@
 #define DOOMDRIVER_H
 
 #include "harddoom2.h"
+#include "doomdev2.h"
 
 
 #include <linux/pci.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
-#include <linux/semaphore.h>
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/dma-buf.h>
 
 
 #define MAX_DEVICE_COUNT 256
+// minor of /dev/doom-any, right after those of the devices
+#define DOOM_ANY_MINOR MAX_DEVICE_COUNT
 
 #define DOOMHDR "[HardDoom2] "
 #define DRIVER_NAME "harddoom2"
@@ -22,22 +27,116 @@
 
 #define OOBOUNDS(min, max, elt) ((min) > (elt) || (max) < (elt))
 
+// doombuffer flags
+#define DOOMBUFFER_USERPTR 0x01 // pages pinned from user memory
+#define DOOMBUFFER_READONLY 0x02 // neither the device nor write() may modify the pages, save for a frame grab
+#define DOOMBUFFER_DMABUF 0x04 // imported dma-buf, no struct pages of our own
+#define DOOMBUFFER_SHARED 0x08 // view holding a reference on a shared cache entry
+#define DOOMBUFFER_DONTNEED 0x10 // contents may be discarded under memory pressure
+#define DOOMBUFFER_PURGED 0x20 // contents discarded, pages replaced by the dummy page
+#define DOOMBUFFER_ATTACHED 0x40 // view on another device, with its own DMA mappings
+#define DOOMBUFFER_EXPORTED 0x80 // exported as a dma-buf or mapped writable, may be written behind our back
+
+#define DOOMBUFFER_MAX_PAGES (2048*2048/PAGE_SIZE)
+
+#define PTE_DMA_ADDR(pte) ((dma_addr_t)((pte) & HARDDOOM2_PTE_PHYS_MASK) << 8)
+
 
 typedef struct {uint32_t w[8];} cmd_t;
 
 
+// FE microcode loaded from a firmware file
+struct doomcode
+{
+    char name[64];
+    uint32_t count;
+    uint32_t cells[];
+};
+
+
 struct doomdevice
 {
     int id;
     void __iomem* registers;
+    // register file of a null device, which has no hardware behind it
+    uint32_t* null_regs;
     struct doombuffer* cmd;
 
     struct pci_dev* pci_device;
+    // what DMA mappings and firmware requests go through: the PCI function,
+    // or a platform device for null devices
+    struct device* dev;
     struct device* chr_device;
+    // NUMA node the device is attached to
+    int node;
 
     int enabled;
     struct mutex lock;
-    struct semaphore wait_pong;
+    // completed by PONG_SYNC or a fault
+    struct completion pong;
+    // NULL for the built-in microcode
+    struct doomcode* code;
+
+    // load, as seen by /dev/doom-any: open contexts and submitters waiting
+    // for or holding the device; online once it can take contexts
+    int online;
+    atomic_t contexts;
+    atomic_t queued;
+    // held by the driver until removal and by every open context, which may
+    // outlive it
+    struct kref ref;
+    // MSI vector if available, latched INTR bits for the IRQ thread
+    int irq;
+    atomic_t intr_pending;
+    // fault recoveries so far, and how long they took
+    unsigned long reset_c;
+    uint64_t reset_last_ns;
+    uint64_t reset_total_ns;
+    // a batch making no progress for this long is a hang; hangs so far,
+    // and the longest a batch took from kick to completion
+    unsigned int watchdog_ms;
+    unsigned long hang_c;
+    uint64_t batch_max_ns;
+    uint64_t kick_ns;
+    // surface and shadow of a frame grab left running after its ioctl
+    // returned; see ring_drain
+    struct file* grab[2];
+
+    // freed pages kept mapped for reuse, trimmed by the shrinker
+    spinlock_t pool_lock;
+    struct list_head pool;
+    unsigned long pool_c;
+    struct shrinker* shrinker;
+
+    // buffers holding pages allocated by the driver, for accounting
+    spinlock_t buffers_lock;
+    struct list_head buffers;
+    atomic64_t mem_used;
+    // bytes of buffer pages per NUMA node, nr_node_ids entries
+    atomic64_t* node_used;
+
+    // content-addressed read-only buffers, see shared.c
+    struct mutex shared_lock;
+    struct list_head shared;
+
+    // DONTNEED buffers the shrinker may purge, and their page count
+    struct mutex purge_lock;
+    struct list_head purgeable;
+    unsigned long purgeable_c;
+    // mapped in place of the pages of purged buffers
+    struct page* dummy_page;
+    dma_addr_t dummy_handle;
+    uint8_t* dummy_vaddr;
+
+    // source of buffer generations, so that a new buffer never matches what
+    // the device remembers of a freed one
+    atomic64_t gen_seq;
+    // what the last SETUP pointed the device at (page table generations,
+    // 0 for no buffer), and the content generation of each buffer when the
+    // device last dropped its caches of it; see ring_bind
+    int setup_valid;
+    uint64_t setup_pt_gen[7];
+    uint64_t setup_gen[7];
 };
 
 struct doomfile
@@ -57,6 +156,19 @@ struct doomfile
 
     struct doomdev2_cmd* raw_cmds;
 
+    // opened through /dev/doom-any; placed once it has used its device
+    int any;
+    int placed;
+
+    // contexts of other devices drawing bands of surf_dst along with this
+    // one, and how many split contexts use this one as a band
+    struct file* split[DOOMDEV2_SPLIT_MAX];
+    uint32_t split_c;
+    uint32_t helper_c;
+
+    // read-only copies made by DOOMDEV2_IOCTL_GRAB_FRAME, see frame.c
+    struct file* shadows[DOOMDEV2_GRAB_SHADOWS];
+
     struct mutex lock;
     struct doomdevice* device;
 };
@@ -65,19 +177,113 @@ struct doombuffer
 {
     uint32_t* dev_pagetable;
     dma_addr_t dev_pagetable_handle;
-    uint8_t** usr_pagetable;
+    struct page** pages;
+    // contiguous kernel mapping of all the pages
+    uint8_t* vaddr;
     uint32_t page_c;
     uint32_t size;
     // width and height only in use for the surface
     uint32_t width;
     uint32_t height;
     struct file* file;
+    // set for views, which borrow the pages of the parent buffer; the
+    // parent may belong to another device for attached buffers
+    struct doombuffer* parent;
+    int flags;
+    // the mm charged for pinned userptr pages
+    struct mm_struct* mm;
+    // imported dma-buf mapping
+    struct dma_buf_attachment* attach;
+    struct sg_table* sgt;
+    // process charged for the pages, and its place on the device list
+    struct pid* owner;
+    struct list_head node;
+    // cache entry, if this is the hidden owner of a shared buffer
+    struct doomshared* shared;
+    // place on the device purgeable list
+    struct list_head purge_node;
+    // stamped from the device sequence when the page table is built, and on
+    // the root whenever the contents change
+    uint64_t pt_gen;
+    uint64_t gen;
+    // device whose frame grab still reads or writes the pages, on the root
+    struct doomdevice* grabbed_by;
+    // the last frame grab into this shadow failed, its contents are garbage
+    // until the next grab succeeds
+    int grab_failed;
 
     struct mutex lock;
     struct doomdevice* device;
 };
 
 
+// contents and geometry of one buffer, kept in kernel memory
+struct doomsnapshot_entry
+{
+    uint32_t size;
+    uint32_t width;
+    uint32_t height;
+    uint8_t* data;
+};
+
+struct doomsnapshot
+{
+    struct doomdevice* device;
+    uint32_t count;
+    struct doomsnapshot_entry entries[];
+};
+
+
+uint32_t null_ioread(struct doomdevice* device, unsigned int reg);
+void null_iowrite(struct doomdevice* device, uint32_t value, unsigned int reg);
+
+
+// all register access goes through these, null devices emulate it
+static inline uint32_t doom_ioread(struct doomdevice* device, unsigned int reg)
+{
+    if (unlikely(device->null_regs != NULL))
+        return null_ioread(device, reg);
+    return ioread32(device->registers+reg);
+}
+
+static inline void doom_iowrite(struct doomdevice* device, uint32_t value, unsigned int reg)
+{
+    if (unlikely(device->null_regs != NULL))
+        null_iowrite(device, value, reg);
+    else
+        iowrite32(value, device->registers+reg);
+}
+
+// for windows, which take all the values at the same address
+static inline void doom_iowrite_rep(struct doomdevice* device, unsigned int reg, const uint32_t* values, size_t count)
+{
+    if (likely(device->null_regs == NULL))
+        iowrite32_rep(device->registers+reg, values, count);
+}
+
+
+// views share the flags and pages of their parent
+static inline struct doombuffer* buffer_root(struct doombuffer* buf)
+{
+    return buf->parent != NULL ? buf->parent : buf;
+}
+
+
+static inline uint64_t next_gen(struct doomdevice* device)
+{
+    return atomic64_inc_return(&device->gen_seq);
+}
+
+
+// the contents changed, whatever a device has cached of them is stale
+static inline void buffer_touch(struct doombuffer* buf)
+{
+    struct doombuffer* root = buffer_root(buf);
+
+    WRITE_ONCE(root->gen, next_gen(root->device));
+}
+
+
 extern struct doomdevice* devices[];
 extern struct kmem_cache* doombuffer_cache;
 
@@ -88,15 +294,101 @@ void chardev_destroy(struct doomdevice* doomdev);
 int chardev_init(void);
 void chardev_exit(void);
 
+// caller holds the device lock
+uint32_t ring_begin(struct doomdevice* device);
+void ring_push(struct doomdevice* device, uint32_t* pos, cmd_t* command);
+void ring_setup(struct doomdevice* device, uint32_t* pos, struct doombuffer** buffers);
+void ring_bind(struct doomdevice* device, uint32_t* pos, struct doombuffer** buffers);
+void ring_kick(struct doomdevice* device, uint32_t pos);
+int ring_wait(struct doomdevice* device);
+int ring_kick_wait(struct doomdevice* device, uint32_t pos);
+void ring_quiesce(struct doomdevice* device);
+void ring_drain(struct doomdevice* device);
+int ring_ready(struct doomdevice* device);
+
+extern struct file_operations doom_fops;
 
-struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uint32_t width, uint32_t height);
+struct file* open_buffer_file(struct doombuffer* buf);
+
+int decode_cmd(struct doomfile* df, cmd_t* decoded_cmd, struct doomdev2_cmd* raw_cmd);
+
+
+struct doombuffer* alloc_pagetable(struct doomdevice* device, uint32_t size, uint32_t width, uint32_t height, int node);
+struct doombuffer* alloc_userptr(struct doomdevice* device, unsigned long addr, uint32_t size, int readonly);
+struct doombuffer* alloc_view(struct doombuffer* src, uint32_t offset, uint32_t size);
+struct doombuffer* alloc_attached(struct doomdevice* device, struct doombuffer* src);
 void free_pagetable(struct doombuffer* buf);
+int buffer_pool_init(struct doomdevice* device);
+void buffer_pool_exit(struct doomdevice* device);
+int alloc_dev_pagetable(struct doombuffer* buf, int n_pages);
+void free_dev_pagetable(struct doombuffer* buf, int n_pages);
+int sync_buffer_for_cpu(struct doombuffer* buf, loff_t pos, size_t count);
+int sync_buffer_cpu_done(struct doombuffer* buf, loff_t pos, size_t count, int written);
+void sync_buffer_for_device(struct doombuffer* buf, loff_t pos, size_t count);
+int buffer_device_usable(struct doombuffer* buf);
+int load_buffer_from_file(struct doombuffer* buf, uint32_t offset, struct file* file, loff_t pos, uint32_t size);
+int copy_surface_rect(struct doombuffer* buf, const struct doomdev2_ioctl_surface_rect* rect, int to_user);
 
 extern struct file_operations buffer_fops;
 
 
+int export_buffer_dmabuf(struct doombuffer* buf, uint32_t flags);
+struct doombuffer* import_dmabuf(struct doomdevice* device, int fd, uint32_t width, uint32_t height);
+void release_imported_dmabuf(struct doombuffer* buf);
+
+
+extern const struct attribute_group* doom_groups[];
+
+
+struct doombuffer* get_shared_buffer(struct doomdevice* device, const void __user* data,
+    uint32_t size, uint32_t width, uint32_t height);
+void put_shared_buffer(struct doombuffer* root);
+
+
+extern struct file_operations snapshot_fops;
+
+struct doomsnapshot* take_snapshot(struct doomdevice* device, struct doombuffer** buffers, uint32_t count);
+int restore_snapshot_entry(const struct doomsnapshot_entry* entry, struct doombuffer* buf);
+void free_snapshot(struct doomsnapshot* snap);
+
+
+int blit_buffer_range(struct doombuffer* src, uint32_t src_off,
+    struct doombuffer* dst, uint32_t dst_off, uint32_t size, uint8_t value);
+
+
+int set_split(struct doomfile* df, const int32_t* fds, uint32_t count);
+void clear_split(struct doomfile* df);
+int split_write(struct doomfile* df, uint32_t count);
+
+int grab_frame(struct doomfile* df, int32_t surface_fd);
+void release_shadows(struct doomfile* df);
+void wait_grab(struct doombuffer* buf);
+
+
+void probe_microcode(struct doomdevice* doomdev);
+void free_microcode(struct doomdevice* doomdev);
+void upload_microcode(struct doomdevice* doomdev);
+const char* microcode_name(struct doomdevice* doomdev);
+uint32_t microcode_size(struct doomdevice* doomdev);
+int reload_microcode(struct doomdevice* doomdev, const char* name);
+
+
+struct doomdevice* doomdev_alloc(int node);
+void doomdev_free(struct doomdevice* doomdev);
+void doomdev_set_online(struct doomdevice* doomdev, int online);
+int doomdev_start(struct doomdevice* doomdev);
+void doomdev_stop(struct doomdevice* doomdev);
+void doomdev_restart(struct doomdevice* doomdev);
+void doomdev_recover(struct doomdevice* doomdev);
+struct doomdevice* pick_device(int node);
+struct doomdevice* get_device_context(int id);
+void put_device_context(struct doomdevice* doomdev);
+
 int pci_init(void);
 void pci_exit(void);
 
+int null_init(void);
+void null_exit(void);
+
 
 #endif // DOOMDRIVER_H
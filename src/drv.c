@@ -6,6 +6,7 @@
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Wojciech Jablonski");
 MODULE_DESCRIPTION("HardDoom2 device driver for Advanced Operating Systems class");
+MODULE_IMPORT_NS(DMA_BUF);
 
 
 
@@ -20,8 +21,14 @@ int harddoom2_init(void)
     if ((err = pci_init()))
         goto err_pci_init;
 
+    if ((err = null_init()))
+        goto err_null_init;
+
     return 0;
 
+    null_exit();
+err_null_init:
+
     pci_exit();
 err_pci_init:
 
@@ -35,6 +42,7 @@ err_chardev_init:
 void harddoom2_exit(void)
 {
     // no need for lock since noone uses the doomdevice right now
+    null_exit();
     pci_exit();
     chardev_exit();
     printk(KERN_INFO DOOMHDR "Unloading HardDoom ][ (TM) module\n");
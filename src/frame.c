@@ -0,0 +1,184 @@
+#include "doomdriver.h"
+#include "doomdev2.h"
+
+#include <linux/err.h>
+#include <linux/file.h>
+
+
+// a pooled shadow is handed out again once the context holds its only
+// reference: no fd, no mapping and no copy in flight; caller holds the
+// context lock
+static struct file* get_shadow(struct doomfile* df, struct doombuffer* surface)
+{
+    struct doombuffer* shadow;
+    struct file* file;
+    int slot = -1;
+    int i;
+
+    for (i = 0; i < DOOMDEV2_GRAB_SHADOWS; i++)
+    {
+        if (df->shadows[i] == NULL)
+        {
+            if (slot < 0)
+                slot = i;
+            continue;
+        }
+
+        if (file_count(df->shadows[i]) != 1)
+            continue;
+
+        shadow = df->shadows[i]->private_data;
+        if (shadow->width == surface->width && shadow->height == surface->height)
+            return df->shadows[i];
+
+        // idle, but for another resolution
+        if (slot < 0)
+            slot = i;
+    }
+
+    if (slot < 0)
+        return ERR_PTR(-EBUSY);
+
+    if (IS_ERR(shadow = alloc_pagetable(df->device, surface->width * surface->height,
+        surface->width, surface->height, df->device->node)))
+        return ERR_CAST(shadow);
+
+    // only the grab itself writes it, clients can just read and map it
+    shadow->flags |= DOOMBUFFER_READONLY;
+
+    if (IS_ERR(file = open_buffer_file(shadow)))
+    {
+        free_pagetable(shadow);
+        return file;
+    }
+
+    if (df->shadows[slot] != NULL)
+        fput(df->shadows[slot]);
+    df->shadows[slot] = file;
+
+    return file;
+}
+
+
+// caller holds the context lock
+int grab_frame(struct doomfile* df, int32_t surface_fd)
+{
+    int err;
+    struct doomdevice* device = df->device;
+    struct file* surface_file;
+    struct file* shadow_file;
+    struct doombuffer* surface;
+    struct doombuffer* shadow;
+    struct doombuffer* buffers[7] = {0};
+    cmd_t copy = {0};
+    uint32_t pos;
+    int fd;
+
+    if ((surface_file = fget(surface_fd)) == NULL)
+    {
+        err = EBADF;
+        goto err_fget;
+    }
+
+    surface = surface_file->private_data;
+
+    if (surface_file->f_op != &buffer_fops || surface->device != device || surface->width == 0)
+    {
+        err = EINVAL;
+        goto err_surface;
+    }
+
+    if (!buffer_device_usable(surface))
+    {
+        err = EBUSY;
+        goto err_surface;
+    }
+
+    if (IS_ERR(shadow_file = get_shadow(df, surface)))
+    {
+        err = -PTR_ERR(shadow_file);
+        goto err_shadow;
+    }
+
+    shadow = shadow_file->private_data;
+
+    if ((fd = get_unused_fd_flags(O_RDWR)) < 0)
+    {
+        err = -fd;
+        goto err_get_fd;
+    }
+
+    atomic_inc(&device->queued);
+    mutex_lock(&device->lock);
+
+    if ((err = ring_ready(device)))
+        goto err_enabled;
+
+    buffers[0] = shadow;
+    buffers[1] = surface;
+
+    copy.w[0] = HARDDOOM2_CMD_W0(HARDDOOM2_CMD_TYPE_COPY_RECT, HARDDOOM2_CMD_FLAG_PING_SYNC);
+    copy.w[2] = HARDDOOM2_CMD_W2(0, 0, 0);
+    copy.w[3] = HARDDOOM2_CMD_W3(0, 0);
+    copy.w[6] = HARDDOOM2_CMD_W6_A(surface->width, surface->height, 0);
+
+    pos = ring_begin(device);
+    ring_bind(device, &pos, buffers);
+    ring_push(device, &pos, &copy);
+
+    // both files stay alive until ring_drain is done with the batch, the
+    // one for the fd is taken here
+    device->grab[0] = surface_file;
+    device->grab[1] = get_file(shadow_file);
+    WRITE_ONCE(buffer_root(surface)->grabbed_by, device);
+    WRITE_ONCE(shadow->grabbed_by, device);
+    WRITE_ONCE(shadow->grab_failed, 0);
+    ring_kick(device, pos);
+
+    mutex_unlock(&device->lock);
+    atomic_dec(&device->queued);
+
+    fd_install(fd, get_file(shadow_file));
+
+    return fd;
+
+err_enabled:
+    mutex_unlock(&device->lock);
+    atomic_dec(&device->queued);
+
+    put_unused_fd(fd);
+err_get_fd:
+err_shadow:
+err_surface:
+
+    fput(surface_file);
+err_fget:
+
+    return -err;
+}
+
+
+// the pool goes away with the context, shadows still handed out live on
+void release_shadows(struct doomfile* df)
+{
+    int i;
+
+    for (i = 0; i < DOOMDEV2_GRAB_SHADOWS; i++)
+        if (df->shadows[i] != NULL)
+            fput(df->shadows[i]);
+}
+
+
+// the CPU is about to touch the buffer, so a frame grab still copying from
+// or into it has to finish first
+void wait_grab(struct doombuffer* buf)
+{
+    struct doomdevice* device = READ_ONCE(buffer_root(buf)->grabbed_by);
+
+    if (device == NULL)
+        return;
+
+    mutex_lock(&device->lock);
+    ring_drain(device);
+    mutex_unlock(&device->lock);
+}
@@ -0,0 +1,148 @@
+#include "doomdriver.h"
+#include "doomcode2.h"
+
+#include <linux/err.h>
+#include <linux/firmware.h>
+#include <linux/string.h>
+
+
+static char* firmware = "harddoom2/doomcode2.bin";
+module_param(firmware, charp, 0444);
+MODULE_PARM_DESC(firmware, "FE microcode loaded at probe, the built-in one if missing or empty");
+
+
+// a firmware image: little-endian 32-bit code cells, one 30-bit
+// instruction each, at most the size of the code RAM
+static struct doomcode* load_microcode(struct doomdevice* doomdev, const char* name)
+{
+    int err;
+    const struct firmware* fw;
+    struct doomcode* code;
+    const __le32* cells;
+    uint32_t i;
+
+    if ((err = -firmware_request_nowarn(&fw, name, doomdev->dev)))
+        goto err_request;
+
+    if (fw->size == 0 || fw->size % sizeof(uint32_t) != 0 ||
+        fw->size / sizeof(uint32_t) > HARDDOOM2_FE_CODE_SIZE)
+    {
+        err = EINVAL;
+        goto err_size;
+    }
+
+    if (0 == (code = kvmalloc(struct_size(code, cells, fw->size / sizeof(uint32_t)), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc;
+    }
+
+    code->count = fw->size / sizeof(uint32_t);
+    strscpy(code->name, name, sizeof(code->name));
+
+    cells = (const __le32*)fw->data;
+    for (i = 0; i < code->count; i++)
+    {
+        code->cells[i] = le32_to_cpu(cells[i]);
+
+        if (code->cells[i] >> 30)
+        {
+            err = EINVAL;
+            goto err_cells;
+        }
+    }
+
+    release_firmware(fw);
+
+    return code;
+
+err_cells:
+    kvfree(code);
+err_alloc:
+err_size:
+
+    release_firmware(fw);
+err_request:
+
+    return ERR_PTR(-err);
+}
+
+
+void probe_microcode(struct doomdevice* doomdev)
+{
+    struct doomcode* code;
+
+    doomdev->code = NULL;
+
+    if (firmware == NULL || firmware[0] == '\0')
+        return;
+
+    if (IS_ERR(code = load_microcode(doomdev, firmware)))
+    {
+        printk(KERN_INFO DOOMHDR "Device %d: no usable microcode %s (%ld), using the built-in one\n",
+            doomdev->id, firmware, PTR_ERR(code));
+        return;
+    }
+
+    doomdev->code = code;
+}
+
+
+void free_microcode(struct doomdevice* doomdev)
+{
+    kvfree(doomdev->code);
+    doomdev->code = NULL;
+}
+
+
+// the window advances the code address by itself
+void upload_microcode(struct doomdevice* doomdev)
+{
+    doom_iowrite(doomdev, 0, HARDDOOM2_FE_CODE_ADDR);
+
+    if (doomdev->code != NULL)
+        doom_iowrite_rep(doomdev, HARDDOOM2_FE_CODE_WINDOW, doomdev->code->cells, doomdev->code->count);
+    else
+        doom_iowrite_rep(doomdev, HARDDOOM2_FE_CODE_WINDOW, doomcode2, ARRAY_SIZE(doomcode2));
+}
+
+
+const char* microcode_name(struct doomdevice* doomdev)
+{
+    return doomdev->code != NULL ? doomdev->code->name : "builtin";
+}
+
+
+uint32_t microcode_size(struct doomdevice* doomdev)
+{
+    return doomdev->code != NULL ? doomdev->code->count : ARRAY_SIZE(doomcode2);
+}
+
+
+// switches to another image (the built-in one for "builtin") and boots the
+// device with it; the image is fetched before taking the device lock, the
+// switch itself waits for the device to go idle
+int reload_microcode(struct doomdevice* doomdev, const char* name)
+{
+    struct doomcode* code = NULL;
+    struct doomcode* old;
+
+    if (strcmp(name, "builtin") != 0 && IS_ERR(code = load_microcode(doomdev, name)))
+        return -PTR_ERR(code);
+
+    mutex_lock(&doomdev->lock);
+    ring_drain(doomdev);
+
+    old = doomdev->code;
+    doomdev->code = code;
+    doomdev_restart(doomdev);
+
+    // a concurrent reload may free the code as soon as the lock is gone
+    printk(KERN_INFO DOOMHDR "Device %d: microcode %s loaded\n", doomdev->id, microcode_name(doomdev));
+
+    mutex_unlock(&doomdev->lock);
+
+    kvfree(old);
+
+    return 0;
+}
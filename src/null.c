@@ -0,0 +1,159 @@
+#include "doomdriver.h"
+
+#include <linux/err.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+
+
+// software-only devices: everything up to writing the ring is the same as
+// for a card, the batch is then done as soon as it is submitted
+static unsigned int null_devices = 0;
+module_param(null_devices, uint, 0444);
+MODULE_PARM_DESC(null_devices, "Devices without hardware, which complete every batch at once");
+
+
+static struct doomdevice** nulls;
+
+
+uint32_t null_ioread(struct doomdevice* device, unsigned int reg)
+{
+    return READ_ONCE(device->null_regs[reg / sizeof(uint32_t)]);
+}
+
+
+void null_iowrite(struct doomdevice* device, uint32_t value, unsigned int reg)
+{
+    WRITE_ONCE(device->null_regs[reg / sizeof(uint32_t)], value);
+
+    // an enabled device finishes the batch right away; every batch ends
+    // with PING_SYNC, so its submitter is woken up
+    if (reg == HARDDOOM2_CMD_WRITE_IDX && device->null_regs[HARDDOOM2_ENABLE / sizeof(uint32_t)] != 0)
+    {
+        WRITE_ONCE(device->null_regs[HARDDOOM2_CMD_READ_IDX / sizeof(uint32_t)], value);
+        complete(&device->pong);
+    }
+}
+
+
+static struct doomdevice* null_create(unsigned int index)
+{
+    int err;
+    struct platform_device* pdev;
+    struct doomdevice* doomdev;
+
+    // stands in for the PCI function, buffers are mapped for it directly
+    if (IS_ERR(pdev = platform_device_register_simple(DRIVER_NAME "-null", index, NULL, 0)))
+    {
+        err = -PTR_ERR(pdev);
+        goto err_pdev;
+    }
+
+    if ((err = -dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(DOOMDEV_ADDRESS_LENGTH))))
+        goto err_dma_mask;
+
+    if (IS_ERR(doomdev = doomdev_alloc(NUMA_NO_NODE)))
+    {
+        err = -PTR_ERR(doomdev);
+        goto err_alloc;
+    }
+
+    doomdev->dev = &pdev->dev;
+
+    if (0 == (doomdev->null_regs = kzalloc(DOOMDEV_REGISTER_SIZE, GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_regs;
+    }
+
+    mutex_lock(&doomdev->lock);
+    if ((err = doomdev_start(doomdev)))
+        goto err_start;
+    mutex_unlock(&doomdev->lock);
+
+    // never online: /dev/doom-any is for real work, benchmarks open
+    // /dev/doomN by name
+    printk(KERN_INFO DOOMHDR "Created null device with ID %d\n", doomdev->id);
+
+    return doomdev;
+
+    mutex_lock(&doomdev->lock);
+    doomdev_stop(doomdev);
+err_start:
+    mutex_unlock(&doomdev->lock);
+
+    kfree(doomdev->null_regs);
+err_regs:
+
+    doomdev_free(doomdev);
+err_alloc:
+err_dma_mask:
+
+    platform_device_unregister(pdev);
+err_pdev:
+
+    return ERR_PTR(-err);
+}
+
+
+static void null_destroy(struct doomdevice* doomdev)
+{
+    struct platform_device* pdev = to_platform_device(doomdev->dev);
+
+    mutex_lock(&doomdev->lock);
+    doomdev_stop(doomdev);
+    mutex_unlock(&doomdev->lock);
+
+    kfree(doomdev->null_regs);
+    doomdev_free(doomdev);
+    platform_device_unregister(pdev);
+}
+
+
+int null_init(void)
+{
+    int err;
+    unsigned int i;
+
+    if (null_devices == 0)
+        return 0;
+
+    if (0 == (nulls = kcalloc(null_devices, sizeof(struct doomdevice*), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc;
+    }
+
+    for (i = 0; i < null_devices; i++)
+    {
+        if (IS_ERR(nulls[i] = null_create(i)))
+        {
+            err = -PTR_ERR(nulls[i]);
+            goto err_create;
+        }
+    }
+
+    return 0;
+
+err_create:
+    while (i)
+        null_destroy(nulls[--i]);
+
+    kfree(nulls);
+err_alloc:
+
+    return -err;
+}
+
+
+void null_exit(void)
+{
+    unsigned int i;
+
+    if (null_devices == 0)
+        return;
+
+    for (i = 0; i < null_devices; i++)
+        null_destroy(nulls[i]);
+
+    kfree(nulls);
+}
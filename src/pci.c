@@ -1,8 +1,8 @@
 #include "doomdriver.h"
-#include "doomcode2.h"
 
 #include <linux/err.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
 
 
 static DEFINE_MUTEX(global_driver_lock);
@@ -27,6 +27,10 @@ static struct pci_driver drv = {
     .probe = doomdev_probe,
     .remove = doomdev_remove,
     .shutdown = doomdev_shutdown,
+    // cards boot in parallel, each /dev/doomN appears once its card is up
+    .driver = {
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+    },
 };
 
 
@@ -34,6 +38,42 @@ struct doomdevice* devices[MAX_DEVICE_COUNT];
 static struct kmem_cache* doomdevice_cache;
 
 
+static unsigned int watchdog_ms = 2000;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Initial watchdog timeout of new devices, see the watchdog_ms attribute");
+
+
+static const char* const intr_names[] = {
+    "FENCE", "PONG_SYNC", "PONG_ASYNC", "", "FE_ERROR", "CMD_OVERFLOW",
+    "SURF_DST_OVERFLOW", "SURF_SRC_OVERFLOW", "PAGE_FAULT_CMD",
+    "PAGE_FAULT_SURF_DST", "PAGE_FAULT_SURF_SRC", "PAGE_FAULT_TEXTURE",
+    "PAGE_FAULT_FLAT", "PAGE_FAULT_TRANSLATION", "PAGE_FAULT_COLORMAP",
+    "PAGE_FAULT_TRANMAP",
+};
+
+
+static void report_fault(struct doomdevice* doomdev, uint32_t intr)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(intr_names); i++)
+    {
+        if (!(intr & (1 << i)) || (1 << i) == HARDDOOM2_INTR_PONG_SYNC)
+            continue;
+
+        if ((1 << i) == HARDDOOM2_INTR_FE_ERROR)
+            printk(KERN_ERR DOOMHDR "Device %d: FE_ERROR, code %x\n", doomdev->id,
+                doom_ioread(doomdev, HARDDOOM2_FE_ERROR_CODE) & HARDDOOM2_FE_ERROR_CODE_MASK);
+        else if ((1 << i) & HARDDOOM2_INTR_PAGE_FAULT(0xff))
+            printk(KERN_ERR DOOMHDR "Device %d: %s at %x\n", doomdev->id, intr_names[i],
+                doom_ioread(doomdev, HARDDOOM2_TLB_VADDR(i - 8)) & HARDDOOM2_TLB_VADDR_MASK);
+        else
+            printk(KERN_ERR DOOMHDR "Device %d: %s\n", doomdev->id, intr_names[i]);
+    }
+}
+
+
+// only acks and latches, the thread does the rest
 static irqreturn_t doomdev_irq_handler(int irq, void *dev)
 {
     uint32_t intr;
@@ -41,33 +81,108 @@ static irqreturn_t doomdev_irq_handler(int irq, void *dev)
 
     doomdev = dev;
 
-    intr = ioread32(doomdev->registers + HARDDOOM2_INTR);
+    intr = doom_ioread(doomdev, HARDDOOM2_INTR);
     if (intr == 0)
         return IRQ_NONE;
 
-    iowrite32(intr, doomdev->registers + HARDDOOM2_INTR);
+    doom_iowrite(doomdev, intr, HARDDOOM2_INTR);
+    atomic_or(intr, &doomdev->intr_pending);
+
+    return IRQ_WAKE_THREAD;
+}
+
+
+// everything latched since the last run is handled at once
+static irqreturn_t doomdev_irq_thread(int irq, void *dev)
+{
+    uint32_t intr;
+    struct doomdevice* doomdev;
+
+    doomdev = dev;
+
+    intr = atomic_xchg(&doomdev->intr_pending, 0);
+    if (intr == 0)
+        return IRQ_NONE;
 
     if (intr & HARDDOOM2_INTR_PONG_SYNC)
-        up(&doomdev->wait_pong);
+        complete(&doomdev->pong);
 
+    // the waiter sees the device disabled and resets it, see doomdev_recover
     if (intr & (~HARDDOOM2_INTR_PONG_SYNC))
     {
+        report_fault(doomdev, intr);
         doomdev->enabled = 0;
-        up(&doomdev->wait_pong);
-        printk(KERN_ERR DOOMHDR "Interrupts caught on device %d: %x\n", doomdev->id, intr);
-        printk(KERN_ERR DOOMHDR "Disabling the device %d, please restart it manually", doomdev->id);
+        complete(&doomdev->pong);
     }
 
     return IRQ_HANDLED;
 }
 
 
-static int doomdev_probe (struct pci_dev *dev, const struct pci_device_id *dev_id)
+// loads the microcode and starts the device with an empty ring
+static void doomdev_boot(struct doomdevice* doomdev)
+{
+    upload_microcode(doomdev);
+
+    doom_iowrite(doomdev, HARDDOOM2_RESET_ALL, HARDDOOM2_RESET);
+    doom_iowrite(doomdev, HARDDOOM2_INTR_MASK, HARDDOOM2_INTR);
+    doom_iowrite(doomdev, HARDDOOM2_INTR_MASK ^ HARDDOOM2_INTR_FENCE ^ HARDDOOM2_INTR_PONG_ASYNC, HARDDOOM2_INTR_ENABLE);
+
+    doom_iowrite(doomdev, doomdev->cmd->dev_pagetable_handle, HARDDOOM2_CMD_PT);
+    doom_iowrite(doomdev, DOOMDEV_MAX_CMD_COUNT, HARDDOOM2_CMD_SIZE);
+    doom_iowrite(doomdev, 0, HARDDOOM2_CMD_READ_IDX);
+    doom_iowrite(doomdev, 0, HARDDOOM2_CMD_WRITE_IDX);
+
+    doom_iowrite(doomdev, HARDDOOM2_ENABLE_ALL, HARDDOOM2_ENABLE);
+
+    // nothing is set up, the next batch needs a full SETUP
+    doomdev->setup_valid = 0;
+}
+
+
+// stops the device and boots it again with an empty ring; caller holds
+// the device lock
+void doomdev_restart(struct doomdevice* doomdev)
+{
+    doom_iowrite(doomdev, 0, HARDDOOM2_ENABLE);
+    doom_iowrite(doomdev, 0, HARDDOOM2_INTR_ENABLE);
+    if (doomdev->null_regs == NULL)
+        synchronize_irq(doomdev->irq);
+
+    // whatever is left behind must not wake the next waiter
+    atomic_set(&doomdev->intr_pending, 0);
+    reinit_completion(&doomdev->pong);
+
+    doomdev_boot(doomdev);
+    doomdev->enabled = 1;
+}
+
+
+// resets a device after a fault or a hang; caller holds the device lock.
+// Every submitter drains a pending frame grab before kicking its own batch,
+// so the failed batch was the only work on the device and there is nothing
+// of other contexts to resubmit
+void doomdev_recover(struct doomdevice* doomdev)
+{
+    ktime_t start = ktime_get();
+    uint64_t took;
+
+    doomdev_restart(doomdev);
+
+    took = ktime_to_ns(ktime_sub(ktime_get(), start));
+    WRITE_ONCE(doomdev->reset_c, doomdev->reset_c + 1);
+    WRITE_ONCE(doomdev->reset_last_ns, took);
+    WRITE_ONCE(doomdev->reset_total_ns, doomdev->reset_total_ns + took);
+
+    printk(KERN_INFO DOOMHDR "Device %d reset in %llu ns\n", doomdev->id, took);
+}
+
+
+// takes a free ID and sets up the software state of a device
+struct doomdevice* doomdev_alloc(int node)
 {
     int id;
     struct doomdevice* doomdev;
-    int err;
-    int i;
 
     mutex_lock(&global_driver_lock);
 
@@ -76,101 +191,207 @@ static int doomdev_probe (struct pci_dev *dev, const struct pci_device_id *dev_i
             break;
     if (id == MAX_DEVICE_COUNT)
     {
-        err = ENOMEM;
-        goto err_dev_count;
+        mutex_unlock(&global_driver_lock);
+        return ERR_PTR(-ENOMEM);
     }
 
-    if (0 == (doomdev = kmem_cache_alloc(doomdevice_cache, 0)))
+    if (0 == (doomdev = kmem_cache_alloc_node(doomdevice_cache, GFP_KERNEL, node)))
     {
-        err = ENOMEM;
-        goto err_cache_alloc;
+        mutex_unlock(&global_driver_lock);
+        return ERR_PTR(-ENOMEM);
     }
 
     doomdev->id = id;
-    doomdev->pci_device = dev;
+    doomdev->pci_device = NULL;
+    doomdev->dev = NULL;
+    doomdev->registers = NULL;
+    doomdev->null_regs = NULL;
+    doomdev->node = node;
     doomdev->enabled = 1;
+    doomdev->online = 0;
+    atomic_set(&doomdev->contexts, 0);
+    atomic_set(&doomdev->queued, 0);
+    kref_init(&doomdev->ref);
+    doomdev->reset_c = 0;
+    doomdev->reset_last_ns = 0;
+    doomdev->reset_total_ns = 0;
+    doomdev->watchdog_ms = watchdog_ms;
+    doomdev->hang_c = 0;
+    doomdev->batch_max_ns = 0;
+    doomdev->grab[0] = NULL;
+    doomdev->grab[1] = NULL;
+    atomic_set(&doomdev->intr_pending, 0);
+    atomic64_set(&doomdev->gen_seq, 0);
     mutex_init(&doomdev->lock);
-    sema_init(&doomdev->wait_pong, 0);
+    init_completion(&doomdev->pong);
     devices[id] = doomdev;
-    pci_set_drvdata(dev, doomdev);
 
     mutex_unlock(&global_driver_lock);
+
+    return doomdev;
+}
+
+
+static void doomdev_release(struct kref* ref)
+{
+    kmem_cache_free(doomdevice_cache, container_of(ref, struct doomdevice, ref));
+}
+
+
+// the ID is free again at once, the memory once the last context is closed
+void doomdev_free(struct doomdevice* doomdev)
+{
+    mutex_lock(&global_driver_lock);
+    devices[doomdev->id] = NULL;
+    mutex_unlock(&global_driver_lock);
+
+    kref_put(&doomdev->ref, doomdev_release);
+}
+
+
+// /dev/doom-any may hand out contexts of the device from now on, or no longer
+void doomdev_set_online(struct doomdevice* doomdev, int online)
+{
+    mutex_lock(&global_driver_lock);
+    doomdev->online = online;
+    mutex_unlock(&global_driver_lock);
+}
+
+
+// what is left once the registers and DMA work: memory, the ring, the
+// microcode and /dev/doomN; caller holds the device lock
+int doomdev_start(struct doomdevice* doomdev)
+{
+    int err;
+
+    // page pool and memory accounting
+    if ((err = buffer_pool_init(doomdev)))
+        goto err_pool_init;
+
+    // command pagetable
+    if (IS_ERR(doomdev->cmd = alloc_pagetable(doomdev, sizeof(cmd_t)*DOOMDEV_MAX_CMD_COUNT, 0, 0, NUMA_NO_NODE)))
+    {
+        err = -PTR_ERR(doomdev->cmd);
+        goto err_cmd_init;
+    }
+    // the ring belongs to the device, not to whoever happened to probe it
+    put_pid(doomdev->cmd->owner);
+    doomdev->cmd->owner = NULL;
+
+    // Boot the device, with the microcode from the firmware file if there is one
+    probe_microcode(doomdev);
+    doomdev_boot(doomdev);
+
+    if ((err = chardev_create(doomdev)))
+        goto err_chardev_create;
+
+    return 0;
+
+    chardev_destroy(doomdev);
+err_chardev_create:
+
+    free_microcode(doomdev);
+    free_pagetable(doomdev->cmd);
+err_cmd_init:
+
+    buffer_pool_exit(doomdev);
+err_pool_init:
+
+    return err;
+}
+
+
+// caller holds the device lock
+void doomdev_stop(struct doomdevice* doomdev)
+{
+    ring_drain(doomdev);
+    chardev_destroy(doomdev);
+    free_microcode(doomdev);
+    free_pagetable(doomdev->cmd);
+    buffer_pool_exit(doomdev);
+}
+
+
+static int doomdev_probe (struct pci_dev *dev, const struct pci_device_id *dev_id)
+{
+    struct doomdevice* doomdev;
+    int err;
+    ktime_t start = ktime_get();
+
+    // only the ID is global, the rest of the boot runs in parallel with
+    // the other cards
+    if (IS_ERR(doomdev = doomdev_alloc(dev_to_node(&dev->dev))))
+        return PTR_ERR(doomdev);
+
+    doomdev->pci_device = dev;
+    doomdev->dev = &dev->dev;
+    pci_set_drvdata(dev, doomdev);
+
     mutex_lock(&doomdev->lock);
 
     // boot the pcie device
-    if ((err = pci_enable_device(dev)))
+    if ((err = -pci_enable_device(dev)))
         goto err_pci_enable;
 
     // MMIO
-    if ((err = pci_request_regions(dev, DRIVER_NAME)))
+    if ((err = -pci_request_regions(dev, DRIVER_NAME)))
         goto err_pci_request_regions;
 
     if ((doomdev->registers = pci_iomap(dev, 0, DOOMDEV_REGISTER_SIZE)) == 0)
+    {
+        err = ENOMEM;
         goto err_pci_iomap;
+    }
 
     // DMA
     pci_set_master(dev);
 
-    if ((err = pci_set_dma_mask(dev, DMA_BIT_MASK(DOOMDEV_ADDRESS_LENGTH))))
+    if ((err = -dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(DOOMDEV_ADDRESS_LENGTH))))
         goto err_pci_dma_mask;
 
-    // if ((err = pci_set_consistent_dma_mask(dev, DMA_BIT_MASK(DOOMDEV_ADDRESS_LENGTH))))
-    //     goto err_pci_dma_mask;
-
-    // Interrupts
-    if ((err = request_irq(
-        dev->irq, doomdev_irq_handler, IRQF_SHARED, DRIVER_NAME, doomdev)))
-        goto err_irq;
-
-    // command pagetable
-    if (IS_ERR(doomdev->cmd = alloc_pagetable(doomdev, sizeof(cmd_t)*DOOMDEV_MAX_CMD_COUNT, 0, 0)))
+    // Interrupts, MSI unless only the legacy line is there; only that one
+    // may be shared with other devices
+    if ((err = pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_MSI | PCI_IRQ_INTX)) < 0)
     {
-        err = PTR_ERR(doomdev->cmd);
-        goto err_cmd_init;
+        err = -err;
+        goto err_irq_vectors;
     }
+    doomdev->irq = pci_irq_vector(dev, 0);
 
-    // Boot the device
-    iowrite32(0, doomdev->registers+HARDDOOM2_FE_CODE_ADDR);
-    for (i=0; i<sizeof(doomcode2)/sizeof(uint32_t); i++)
-        iowrite32(doomcode2[i], doomdev->registers+HARDDOOM2_FE_CODE_WINDOW);
-
-    iowrite32(HARDDOOM2_RESET_ALL, doomdev->registers+HARDDOOM2_RESET);
-    iowrite32(HARDDOOM2_INTR_MASK, doomdev->registers+HARDDOOM2_INTR);
-    iowrite32(HARDDOOM2_INTR_MASK ^ HARDDOOM2_INTR_FENCE ^ HARDDOOM2_INTR_PONG_ASYNC, doomdev->registers+HARDDOOM2_INTR_ENABLE);
-
-    iowrite32(doomdev->cmd->dev_pagetable_handle, doomdev->registers+HARDDOOM2_CMD_PT);
-    iowrite32(DOOMDEV_MAX_CMD_COUNT, doomdev->registers+HARDDOOM2_CMD_SIZE);
-    iowrite32(0, doomdev->registers+HARDDOOM2_CMD_READ_IDX);
-    iowrite32(0, doomdev->registers+HARDDOOM2_CMD_WRITE_IDX);
-
-    iowrite32(HARDDOOM2_ENABLE_ALL, doomdev->registers+HARDDOOM2_ENABLE);
+    if ((err = -request_threaded_irq(
+        doomdev->irq, doomdev_irq_handler, doomdev_irq_thread,
+        dev->msi_enabled ? 0 : IRQF_SHARED, DRIVER_NAME, doomdev)))
+        goto err_irq;
 
-    if ((err = chardev_create(doomdev)))
-        goto err_chardev_create;
+    if ((err = doomdev_start(doomdev)))
+        goto err_start;
 
     mutex_unlock(&doomdev->lock);
 
-    printk(KERN_INFO DOOMHDR "Loaded device (vendor %x, dev %x) with ID %d\n",
+    doomdev_set_online(doomdev, 1);
+
+    printk(KERN_INFO DOOMHDR "Loaded device (vendor %x, dev %x) with ID %d in %lld us\n",
         dev_id->vendor,
         dev_id->device,
-        id
+        doomdev->id,
+        ktime_us_delta(ktime_get(), start)
     );
 
     return 0;
 
     mutex_lock(&doomdev->lock);
 
-    chardev_destroy(doomdev);
-
-err_chardev_create:
-    free_pagetable(doomdev->cmd);
+    doomdev_stop(doomdev);
 
-err_cmd_init:
-    iowrite32(0, doomdev->registers+HARDDOOM2_ENABLE);
-    iowrite32(0, doomdev->registers+HARDDOOM2_INTR_ENABLE);
-    free_irq(dev->irq, doomdev);
+err_start:
+    doom_iowrite(doomdev, 0, HARDDOOM2_ENABLE);
+    doom_iowrite(doomdev, 0, HARDDOOM2_INTR_ENABLE);
+    free_irq(doomdev->irq, doomdev);
 
 err_irq:
+    pci_free_irq_vectors(dev);
+
+err_irq_vectors:
 err_pci_dma_mask:
     pci_clear_master(dev);
     pci_iounmap(dev, doomdev->registers);
@@ -183,15 +404,9 @@ err_pci_request_regions:
 
 err_pci_enable:
     mutex_unlock(&doomdev->lock);
-    mutex_lock(&global_driver_lock);
-    kmem_cache_free(doomdevice_cache, doomdev);
-    devices[id] = NULL;
-
-err_cache_alloc:
-err_dev_count:
-    mutex_unlock(&global_driver_lock);
+    doomdev_free(doomdev);
 
-    return err;
+    return -err;
 }
 
 
@@ -201,15 +416,16 @@ static void doomdev_remove (struct pci_dev *dev)
     struct doomdevice* doomdev;
     doomdev = pci_get_drvdata(dev);
 
-    mutex_lock(&doomdev->lock);
+    doomdev_set_online(doomdev, 0);
 
-    chardev_destroy(doomdev);
+    mutex_lock(&doomdev->lock);
 
-    free_pagetable(doomdev->cmd);
+    doomdev_stop(doomdev);
 
-    iowrite32(0, doomdev->registers+HARDDOOM2_INTR_ENABLE);
-    iowrite32(0, doomdev->registers+HARDDOOM2_ENABLE);
-    free_irq(dev->irq, doomdev);
+    doom_iowrite(doomdev, 0, HARDDOOM2_INTR_ENABLE);
+    doom_iowrite(doomdev, 0, HARDDOOM2_ENABLE);
+    free_irq(doomdev->irq, doomdev);
+    pci_free_irq_vectors(dev);
 
     pci_clear_master(dev);
     pci_iounmap(dev, doomdev->registers);
@@ -217,13 +433,9 @@ static void doomdev_remove (struct pci_dev *dev)
     pci_disable_device(dev);
 
     mutex_unlock(&doomdev->lock);
-    mutex_lock(&global_driver_lock);
 
     id = doomdev->id;
-    devices[id] = NULL;
-    kmem_cache_free(doomdevice_cache, doomdev);
-
-    mutex_unlock(&global_driver_lock);
+    doomdev_free(doomdev);
 
     printk(KERN_INFO DOOMHDR "Removed device with ID %d\n", id);
 }
@@ -233,6 +445,83 @@ static void doomdev_shutdown (struct pci_dev *dev)
 {}
 
 
+// queued work first, then open contexts, then memory
+static int less_loaded(struct doomdevice* a, struct doomdevice* b)
+{
+    if (atomic_read(&a->queued) != atomic_read(&b->queued))
+        return atomic_read(&a->queued) < atomic_read(&b->queued);
+
+    if (atomic_read(&a->contexts) != atomic_read(&b->contexts))
+        return atomic_read(&a->contexts) < atomic_read(&b->contexts);
+
+    return atomic64_read(&a->mem_used) < atomic64_read(&b->mem_used);
+}
+
+
+// the least loaded online device on the node (any node for NUMA_NO_NODE,
+// or if the node has none), with a context already counted on it; the
+// context drops it with put_device_context
+struct doomdevice* pick_device(int node)
+{
+    struct doomdevice* best = NULL;
+    int id;
+
+    mutex_lock(&global_driver_lock);
+
+    for (id=0; id<MAX_DEVICE_COUNT; id++)
+    {
+        struct doomdevice* doomdev = devices[id];
+
+        if (doomdev == NULL || !doomdev->online)
+            continue;
+        if (node != NUMA_NO_NODE && doomdev->node != node)
+            continue;
+        if (best == NULL || less_loaded(doomdev, best))
+            best = doomdev;
+    }
+
+    // counted under the lock, so that simultaneous opens spread out
+    if (best != NULL)
+    {
+        atomic_inc(&best->contexts);
+        kref_get(&best->ref);
+    }
+
+    mutex_unlock(&global_driver_lock);
+
+    if (best == NULL && node != NUMA_NO_NODE)
+        return pick_device(NUMA_NO_NODE);
+
+    return best;
+}
+
+
+// the device behind /dev/doomN, with a context counted on it as above
+struct doomdevice* get_device_context(int id)
+{
+    struct doomdevice* doomdev;
+
+    mutex_lock(&global_driver_lock);
+
+    if ((doomdev = devices[id]) != NULL)
+    {
+        atomic_inc(&doomdev->contexts);
+        kref_get(&doomdev->ref);
+    }
+
+    mutex_unlock(&global_driver_lock);
+
+    return doomdev;
+}
+
+
+void put_device_context(struct doomdevice* doomdev)
+{
+    atomic_dec(&doomdev->contexts);
+    kref_put(&doomdev->ref, doomdev_release);
+}
+
+
 int pci_init(void)
 {
     int err;
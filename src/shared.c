@@ -0,0 +1,138 @@
+#include "doomdriver.h"
+
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/uaccess.h>
+#include <crypto/sha2.h>
+
+
+// one per distinct content on a device; the hidden owner buffer lives as
+// long as any view handed out by get_shared_buffer
+struct doomshared
+{
+    struct list_head node;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    struct doombuffer* buf;
+    unsigned int users;
+};
+
+
+static struct doomshared* find_shared(struct doomdevice* device, const uint8_t* digest,
+    uint32_t size, uint32_t width, uint32_t height)
+{
+    struct doomshared* entry;
+
+    list_for_each_entry(entry, &device->shared, node)
+    {
+        if (entry->buf->size == size && entry->buf->width == width && entry->buf->height == height &&
+            memcmp(entry->digest, digest, SHA256_DIGEST_SIZE) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+
+// the returned root has a reference taken for the caller, to be dropped
+// with put_shared_buffer once the caller's view is gone
+struct doombuffer* get_shared_buffer(struct doomdevice* device, const void __user* data,
+    uint32_t size, uint32_t width, uint32_t height)
+{
+    int err;
+    struct doombuffer* buf;
+    struct doomshared* entry;
+    struct file* file;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint32_t i;
+
+    // the contents are hashed here, a key supplied by the user could not be
+    // trusted across processes
+    if (IS_ERR(buf = alloc_pagetable(device, size, width, height, NUMA_NO_NODE)))
+        return buf;
+
+    if (copy_from_user(buf->vaddr, data, size))
+    {
+        err = EFAULT;
+        goto err_copy;
+    }
+
+    sha256(buf->vaddr, size, digest);
+
+    mutex_lock(&device->shared_lock);
+
+    if ((entry = find_shared(device, digest, size, width, height)) != NULL)
+    {
+        entry->users++;
+        mutex_unlock(&device->shared_lock);
+
+        free_pagetable(buf);
+        return entry->buf;
+    }
+
+    if (0 == (entry = kmalloc(sizeof(struct doomshared), GFP_KERNEL)))
+    {
+        err = ENOMEM;
+        goto err_alloc_entry;
+    }
+
+    // the pages are immutable from now on, for the device as well
+    buf->flags |= DOOMBUFFER_READONLY;
+    for (i = 0; i < buf->page_c; i++)
+        buf->dev_pagetable[i] &= ~HARDDOOM2_PTE_WRITABLE;
+    sync_buffer_for_device(buf, 0, size);
+
+    // the file is not installed anywhere, the cache entry owns it
+    if (IS_ERR(file = anon_inode_getfile("doom_buffer", &buffer_fops, buf, O_RDONLY)))
+    {
+        err = -PTR_ERR(file);
+        goto err_file;
+    }
+    buf->file = file;
+    buf->shared = entry;
+
+    memcpy(entry->digest, digest, SHA256_DIGEST_SIZE);
+    entry->buf = buf;
+    entry->users = 1;
+    list_add(&entry->node, &device->shared);
+
+    mutex_unlock(&device->shared_lock);
+
+    return buf;
+
+err_file:
+
+    kfree(entry);
+err_alloc_entry:
+
+    mutex_unlock(&device->shared_lock);
+err_copy:
+
+    free_pagetable(buf);
+
+    return ERR_PTR(-err);
+}
+
+
+void put_shared_buffer(struct doombuffer* root)
+{
+    struct doomdevice* device = root->device;
+    struct doomshared* entry = root->shared;
+
+    mutex_lock(&device->shared_lock);
+
+    if (--entry->users != 0)
+    {
+        mutex_unlock(&device->shared_lock);
+        return;
+    }
+
+    list_del(&entry->node);
+    root->shared = NULL;
+    mutex_unlock(&device->shared_lock);
+
+    kfree(entry);
+    // views still referencing the pages keep the file alive
+    fput(root->file);
+}
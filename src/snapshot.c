@@ -0,0 +1,114 @@
+#include "doomdriver.h"
+
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+
+
+static int snapshot_release(struct inode *ino, struct file *file);
+
+struct file_operations snapshot_fops = {
+    .owner = THIS_MODULE,
+    .release = snapshot_release,
+};
+
+
+void free_snapshot(struct doomsnapshot* snap)
+{
+    uint32_t i;
+
+    for (i = 0; i < snap->count; i++)
+        kvfree(snap->entries[i].data);
+
+    kvfree(snap);
+}
+
+
+static int snapshot_release(struct inode *ino, struct file *file)
+{
+    free_snapshot(file->private_data);
+    return 0;
+}
+
+
+// copies the current contents of the buffers into kernel memory, charged
+// to the caller's cgroup like the buffers themselves
+struct doomsnapshot* take_snapshot(struct doomdevice* device, struct doombuffer** buffers, uint32_t count)
+{
+    int err;
+    struct doomsnapshot* snap;
+
+    if (0 == (snap = kvzalloc(struct_size(snap, entries, count), GFP_KERNEL_ACCOUNT)))
+    {
+        err = ENOMEM;
+        goto err_alloc_snapshot;
+    }
+
+    snap->device = device;
+
+    ring_quiesce(device);
+
+    for (snap->count = 0; snap->count < count; snap->count++)
+    {
+        struct doomsnapshot_entry* entry = &snap->entries[snap->count];
+        struct doombuffer* buf = buffers[snap->count];
+
+        if (0 == (entry->data = kvmalloc(buf->size, GFP_KERNEL_ACCOUNT)))
+        {
+            err = ENOMEM;
+            goto err_alloc_data;
+        }
+
+        entry->size = buf->size;
+        entry->width = buf->width;
+        entry->height = buf->height;
+
+        mutex_lock(&buf->lock);
+        if (0 == (err = sync_buffer_for_cpu(buf, 0, buf->size)))
+        {
+            memcpy(entry->data, buf->vaddr, buf->size);
+            err = sync_buffer_cpu_done(buf, 0, buf->size, 0);
+        }
+        mutex_unlock(&buf->lock);
+
+        if (err)
+            goto err_sync;
+    }
+
+    return snap;
+
+err_sync:
+    kvfree(snap->entries[snap->count].data);
+err_alloc_data:
+
+    free_snapshot(snap);
+err_alloc_snapshot:
+
+    return ERR_PTR(-err);
+}
+
+
+// the buffer has to have the geometry of the snapshotted one
+int restore_snapshot_entry(const struct doomsnapshot_entry* entry, struct doombuffer* buf)
+{
+    int err;
+
+    if (buf->size != entry->size || buf->width != entry->width || buf->height != entry->height)
+        return EINVAL;
+
+    if (buffer_root(buf)->flags & DOOMBUFFER_READONLY)
+        return EPERM;
+
+    mutex_lock(&buf->lock);
+    if (0 == (err = sync_buffer_for_cpu(buf, 0, buf->size)))
+    {
+        memcpy(buf->vaddr, entry->data, buf->size);
+        err = sync_buffer_cpu_done(buf, 0, buf->size, 1);
+        buffer_touch(buf);
+    }
+    mutex_unlock(&buf->lock);
+
+    return err;
+}
@@ -0,0 +1,419 @@
+#include "doomdriver.h"
+#include "doomdev2.h"
+
+#include <linux/file.h>
+
+
+// a context is either split or a band of split contexts, never both, so the
+// file references between contexts cannot form a cycle
+static DEFINE_MUTEX(split_lock);
+
+
+struct split_band
+{
+    struct doomfile* df;
+    // rows of surf_dst drawn by this band
+    uint32_t first;
+    uint32_t end;
+    uint32_t pos;
+    // held back, so that the last command can get PING_SYNC
+    cmd_t last;
+    int has_last;
+};
+
+
+static void drop_split(struct doomfile* df)
+{
+    uint32_t i;
+
+    for (i = 0; i < df->split_c; i++)
+    {
+        ((struct doomfile*)df->split[i]->private_data)->helper_c--;
+        fput(df->split[i]);
+    }
+
+    df->split_c = 0;
+}
+
+
+int set_split(struct doomfile* df, const int32_t* fds, uint32_t count)
+{
+    int err;
+    struct file* files[DOOMDEV2_SPLIT_MAX];
+    struct doomdevice* placement[DOOMDEV2_SPLIT_MAX];
+    struct doomfile* helper;
+    uint32_t i, j;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((files[i] = fget(fds[i])) == NULL)
+        {
+            err = EBADF;
+            goto err_fget;
+        }
+
+        if (files[i]->f_op != &doom_fops)
+        {
+            i++;
+            err = EINVAL;
+            goto err_fget;
+        }
+    }
+
+    mutex_lock(&split_lock);
+    mutex_lock(&df->lock);
+
+    if (df->helper_c != 0)
+    {
+        err = EBUSY;
+        goto err_lock;
+    }
+
+    // one band per device
+    for (i = 0; i < count; i++)
+    {
+        helper = files[i]->private_data;
+
+        if (helper == df)
+        {
+            err = EINVAL;
+            goto err_lock;
+        }
+
+        mutex_lock(&helper->lock);
+        placement[i] = helper->device;
+        mutex_unlock(&helper->lock);
+
+        if (helper->split_c != 0 || placement[i] == df->device)
+        {
+            err = EINVAL;
+            goto err_lock;
+        }
+
+        for (j = 0; j < i; j++)
+            if (placement[j] == placement[i])
+            {
+                err = EINVAL;
+                goto err_lock;
+            }
+    }
+
+    // a /dev/doom-any context must not move away afterwards, but a rejected
+    // split must not pin it either; one that moved meanwhile is refused
+    for (i = 0; i < count; i++)
+    {
+        helper = files[i]->private_data;
+
+        mutex_lock(&helper->lock);
+        err = helper->device == placement[i] ? 0 : EBUSY;
+        if (!err)
+            helper->placed = 1;
+        mutex_unlock(&helper->lock);
+
+        if (err)
+            goto err_lock;
+    }
+
+    drop_split(df);
+
+    for (i = 0; i < count; i++)
+    {
+        ((struct doomfile*)files[i]->private_data)->helper_c++;
+        df->split[i] = files[i];
+    }
+    df->split_c = count;
+
+    mutex_unlock(&df->lock);
+    mutex_unlock(&split_lock);
+
+    return 0;
+
+err_lock:
+    mutex_unlock(&df->lock);
+    mutex_unlock(&split_lock);
+
+    i = count;
+err_fget:
+
+    for (j = 0; j < i; j++)
+        fput(files[j]);
+
+    return err;
+}
+
+
+void clear_split(struct doomfile* df)
+{
+    mutex_lock(&split_lock);
+    drop_split(df);
+    mutex_unlock(&split_lock);
+}
+
+
+// a band has to draw with the very same buffers as the split context, only
+// mapped for its own device
+static int same_buffers(struct doomfile* df, struct doomfile* helper)
+{
+    int i;
+
+    for (i = 0; i < 7; i++)
+    {
+        struct doombuffer* a = df->buffers.array[i];
+        struct doombuffer* b = helper->buffers.array[i];
+
+        if (a == NULL || b == NULL)
+        {
+            if (a != b)
+                return 0;
+            continue;
+        }
+
+        if (buffer_root(a) != buffer_root(b) || a->vaddr != b->vaddr || a->size != b->size ||
+            a->width != b->width || a->height != b->height)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+// commands which read what other bands draw, or whose rasterization depends
+// on where they start, are drawn whole by the first device between runs
+static int is_sync_cmd(struct doomfile* df, const struct doomdev2_cmd* cmd)
+{
+    switch (cmd->type)
+    {
+        case DOOMDEV2_CMD_TYPE_DRAW_LINE:
+        case DOOMDEV2_CMD_TYPE_DRAW_FUZZ:
+            return 1;
+        case DOOMDEV2_CMD_TYPE_COPY_RECT:
+            return buffer_root(df->buffers.name.surf_src) == buffer_root(df->buffers.name.surf_dst);
+        case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+            return cmd->draw_column.pos_a_y > cmd->draw_column.pos_b_y;
+        default:
+            return 0;
+    }
+}
+
+
+// clips the rows [y, y+height) to the band, false if nothing is left
+static int clip_rows(uint32_t* y, uint32_t* height, uint32_t first, uint32_t end)
+{
+    uint32_t a = max(*y, first);
+    uint32_t b = min(*y + *height, end);
+
+    if (a >= b)
+        return 0;
+
+    *y = a;
+    *height = b - a;
+    return 1;
+}
+
+
+// the clipped command stays within the bounds of the validated one
+static int clip_cmd(struct doomdev2_cmd* cmd, uint32_t first, uint32_t end)
+{
+    uint32_t y, height;
+
+    switch (cmd->type)
+    {
+        case DOOMDEV2_CMD_TYPE_COPY_RECT:
+        {
+            y = cmd->copy_rect.pos_dst_y;
+            height = cmd->copy_rect.height;
+            if (!clip_rows(&y, &height, first, end))
+                return 0;
+
+            cmd->copy_rect.pos_src_y += y - cmd->copy_rect.pos_dst_y;
+            cmd->copy_rect.pos_dst_y = y;
+            cmd->copy_rect.height = height;
+            return 1;
+        }
+        case DOOMDEV2_CMD_TYPE_FILL_RECT:
+        {
+            y = cmd->fill_rect.pos_y;
+            height = cmd->fill_rect.height;
+            if (!clip_rows(&y, &height, first, end))
+                return 0;
+
+            cmd->fill_rect.pos_y = y;
+            cmd->fill_rect.height = height;
+            return 1;
+        }
+        case DOOMDEV2_CMD_TYPE_DRAW_BACKGROUND:
+        {
+            // the flat is tiled by absolute position, clipping keeps it aligned
+            y = cmd->draw_background.pos_y;
+            height = cmd->draw_background.height;
+            if (!clip_rows(&y, &height, first, end))
+                return 0;
+
+            cmd->draw_background.pos_y = y;
+            cmd->draw_background.height = height;
+            return 1;
+        }
+        case DOOMDEV2_CMD_TYPE_DRAW_COLUMN:
+        {
+            // inclusive range, the texture coordinate moves with the top row
+            y = cmd->draw_column.pos_a_y;
+            height = cmd->draw_column.pos_b_y - y + 1;
+            if (!clip_rows(&y, &height, first, end))
+                return 0;
+
+            cmd->draw_column.ustart += cmd->draw_column.ustep * (y - cmd->draw_column.pos_a_y);
+            cmd->draw_column.pos_a_y = y;
+            cmd->draw_column.pos_b_y = y + height - 1;
+            return 1;
+        }
+        case DOOMDEV2_CMD_TYPE_DRAW_SPAN:
+        {
+            return first <= cmd->draw_span.pos_y && cmd->draw_span.pos_y < end;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
+}
+
+
+static void band_begin(struct split_band* band)
+{
+    band->pos = ring_begin(band->df->device);
+    band->has_last = 0;
+}
+
+
+// commands are decoded against the split context, whose buffers the bands share
+static void band_push(struct doomfile* df, struct split_band* band, struct doomdev2_cmd* raw_cmd)
+{
+    cmd_t command;
+
+    decode_cmd(df, &command, raw_cmd);
+
+    // bands without commands are not kicked, so they must not bind either
+    if (!band->has_last)
+        ring_bind(band->df->device, &band->pos, band->df->buffers.array);
+    else
+        ring_push(band->df->device, &band->pos, &band->last);
+    band->last = command;
+    band->has_last = 1;
+}
+
+
+// every device is waited for, even when one of them has failed
+static int run_bands(struct split_band* bands, uint32_t band_c)
+{
+    int err = 0;
+    int ret;
+    uint32_t i;
+
+    for (i = 0; i < band_c; i++)
+        if (bands[i].has_last)
+        {
+            bands[i].last.w[0] |= HARDDOOM2_CMD_FLAG_PING_SYNC;
+            ring_push(bands[i].df->device, &bands[i].pos, &bands[i].last);
+            ring_kick(bands[i].df->device, bands[i].pos);
+        }
+
+    for (i = 0; i < band_c; i++)
+        if (bands[i].has_last && (ret = ring_wait(bands[i].df->device)))
+            err = ret;
+
+    return err;
+}
+
+
+// caller holds the lock of the split context; raw_cmds holds count commands
+int split_write(struct doomfile* df, uint32_t count)
+{
+    int err = 0;
+    struct split_band bands[DOOMDEV2_SPLIT_MAX+1];
+    // bands by device id, the order in which they are locked
+    struct split_band* order[DOOMDEV2_SPLIT_MAX+1];
+    uint32_t band_c = df->split_c + 1;
+    uint32_t height;
+    uint32_t cmd_c, i, j;
+    cmd_t command;
+
+    if (df->buffers.name.surf_dst == NULL)
+        return EINVAL;
+
+    // everything is validated up front, nothing is drawn for a bad batch
+    for (cmd_c = 0; cmd_c < count; cmd_c++)
+        if ((err = decode_cmd(df, &command, &df->raw_cmds[cmd_c])))
+            return err;
+
+    height = df->buffers.name.surf_dst->height;
+
+    for (i = 0; i < band_c; i++)
+    {
+        bands[i].df = i == 0 ? df : df->split[i-1]->private_data;
+        bands[i].first = height * i / band_c;
+        bands[i].end = height * (i+1) / band_c;
+
+        for (j = i; j > 0 && order[j-1]->df->device->id > bands[i].df->device->id; j--)
+            order[j] = order[j-1];
+        order[j] = &bands[i];
+    }
+
+    // split contexts are never bands, so their own lock always comes first
+    for (i = 0; i < band_c; i++)
+        if (order[i]->df != df)
+            mutex_lock(&order[i]->df->lock);
+
+    for (i = 1; i < band_c; i++)
+        if (!same_buffers(df, bands[i].df))
+        {
+            err = EINVAL;
+            goto err_buffers;
+        }
+
+    for (i = 0; i < band_c; i++)
+    {
+        atomic_inc(&order[i]->df->device->queued);
+        mutex_lock(&order[i]->df->device->lock);
+    }
+
+    for (i = 0; i < band_c; i++)
+        if ((err = ring_ready(bands[i].df->device)))
+            goto err_devices;
+
+    cmd_c = 0;
+    while (cmd_c < count)
+    {
+        // a run of sync commands uses only the first band
+        int sync = is_sync_cmd(df, &df->raw_cmds[cmd_c]);
+        uint32_t run_c = sync ? 1 : band_c;
+
+        for (i = 0; i < run_c; i++)
+            band_begin(&bands[i]);
+
+        for (; cmd_c < count && is_sync_cmd(df, &df->raw_cmds[cmd_c]) == sync; cmd_c++)
+            for (i = 0; i < run_c; i++)
+            {
+                struct doomdev2_cmd raw = df->raw_cmds[cmd_c];
+
+                if (sync || clip_cmd(&raw, bands[i].first, bands[i].end))
+                    band_push(df, &bands[i], &raw);
+            }
+
+        if ((err = run_bands(bands, run_c)))
+            break;
+    }
+
+err_devices:
+    for (i = band_c; i-- > 0; )
+    {
+        mutex_unlock(&order[i]->df->device->lock);
+        atomic_dec(&order[i]->df->device->queued);
+    }
+err_buffers:
+
+    for (i = band_c; i-- > 0; )
+        if (order[i]->df != df)
+            mutex_unlock(&order[i]->df->lock);
+
+    return err;
+}
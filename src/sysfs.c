@@ -0,0 +1,220 @@
+#include "doomdriver.h"
+
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/pid.h>
+#include <linux/nodemask.h>
+#include <linux/string.h>
+
+
+static ssize_t mem_used_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%lld\n", (long long)atomic64_read(&doomdev->mem_used));
+}
+static DEVICE_ATTR_RO(mem_used);
+
+
+static ssize_t mem_pooled_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%lu\n", READ_ONCE(doomdev->pool_c)*PAGE_SIZE);
+}
+static DEVICE_ATTR_RO(mem_pooled);
+
+
+// one "<node> <bytes>" line per online NUMA node
+static ssize_t mem_nodes_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int node;
+
+    for_each_online_node(node)
+        len += sysfs_emit_at(out, len, "%d %lld\n", node, (long long)atomic64_read(&doomdev->node_used[node]));
+
+    return len;
+}
+static DEVICE_ATTR_RO(mem_nodes);
+
+
+// one "<pid> <bytes>" line per process owning buffers on the device
+static ssize_t mem_clients_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    struct doombuffer* buf;
+    struct doombuffer* other;
+    ssize_t len = 0;
+
+    spin_lock(&doomdev->buffers_lock);
+    list_for_each_entry(buf, &doomdev->buffers, node)
+    {
+        uint64_t bytes = 0;
+        int seen = 0;
+
+        if (buf->owner == NULL)
+            continue;
+
+        // count each process once, at its first buffer on the list
+        list_for_each_entry(other, &doomdev->buffers, node)
+        {
+            if (other == buf)
+                break;
+            if (other->owner == buf->owner)
+            {
+                seen = 1;
+                break;
+            }
+        }
+        if (seen)
+            continue;
+
+        other = buf;
+        list_for_each_entry_from(other, &doomdev->buffers, node)
+            if (other->owner == buf->owner)
+                bytes += PAGE_ALIGN(other->size);
+
+        len += sysfs_emit_at(out, len, "%d %llu\n", pid_nr(buf->owner), bytes);
+    }
+    spin_unlock(&doomdev->buffers_lock);
+
+    return len;
+}
+static DEVICE_ATTR_RO(mem_clients);
+
+
+// "<queued> <contexts>", what /dev/doom-any balances on besides mem_used
+static ssize_t load_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%d %d\n", atomic_read(&doomdev->queued), atomic_read(&doomdev->contexts));
+}
+static DEVICE_ATTR_RO(load);
+
+
+// "<count> <last ns> <total ns>" of resets after device faults
+static ssize_t resets_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%lu %llu %llu\n",
+        READ_ONCE(doomdev->reset_c),
+        READ_ONCE(doomdev->reset_last_ns),
+        READ_ONCE(doomdev->reset_total_ns)
+    );
+}
+static DEVICE_ATTR_RO(resets);
+
+
+// "<hangs> <longest batch ns>", hangs being batches stopped by the watchdog
+static ssize_t hangs_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%lu %llu\n", READ_ONCE(doomdev->hang_c), READ_ONCE(doomdev->batch_max_ns));
+}
+static DEVICE_ATTR_RO(hangs);
+
+
+static ssize_t watchdog_ms_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+
+    return sysfs_emit(out, "%u\n", READ_ONCE(doomdev->watchdog_ms));
+}
+
+static ssize_t watchdog_ms_store(struct device* dev, struct device_attribute* attr, const char* in, size_t count)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    unsigned int ms;
+    int err;
+
+    if ((err = kstrtouint(in, 0, &ms)))
+        return err;
+
+    if (ms == 0)
+        return -EINVAL;
+
+    WRITE_ONCE(doomdev->watchdog_ms, ms);
+
+    return count;
+}
+static DEVICE_ATTR_RW(watchdog_ms);
+
+
+// "<name> <cells>" of the FE microcode; writing a firmware file name (or
+// "builtin") boots the device with it once it is idle
+static ssize_t microcode_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    ssize_t len;
+
+    mutex_lock(&doomdev->lock);
+    len = sysfs_emit(out, "%s %u\n", microcode_name(doomdev), microcode_size(doomdev));
+    mutex_unlock(&doomdev->lock);
+
+    return len;
+}
+
+static ssize_t microcode_store(struct device* dev, struct device_attribute* attr, const char* in, size_t count)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    char name[64];
+    int err;
+
+    if (count == 0 || count >= sizeof(name))
+        return -EINVAL;
+
+    memcpy(name, in, count);
+    name[count] = '\0';
+
+    if ((err = reload_microcode(doomdev, strim(name))))
+        return -err;
+
+    return count;
+}
+static DEVICE_ATTR_RW(microcode);
+
+
+// the STATS counters, space separated; they start from zero on every boot
+// of the device, so also after a microcode reload
+static ssize_t stats_show(struct device* dev, struct device_attribute* attr, char* out)
+{
+    struct doomdevice* doomdev = dev_get_drvdata(dev);
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < HARDDOOM2_STATS_NUM; i++)
+        len += sysfs_emit_at(out, len, i == 0 ? "%u" : " %u", doom_ioread(doomdev, HARDDOOM2_STATS(i)));
+    len += sysfs_emit_at(out, len, "\n");
+
+    return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+
+static struct attribute* doom_attrs[] = {
+    &dev_attr_mem_used.attr,
+    &dev_attr_mem_pooled.attr,
+    &dev_attr_mem_clients.attr,
+    &dev_attr_mem_nodes.attr,
+    &dev_attr_resets.attr,
+    &dev_attr_load.attr,
+    &dev_attr_microcode.attr,
+    &dev_attr_stats.attr,
+    &dev_attr_hangs.attr,
+    &dev_attr_watchdog_ms.attr,
+    NULL,
+};
+
+static const struct attribute_group doom_group = {
+    .attrs = doom_attrs,
+};
+
+const struct attribute_group* doom_groups[] = {
+    &doom_group,
+    NULL,
+};